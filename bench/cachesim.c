@@ -0,0 +1,364 @@
+/**
+ * @file cachesim.c
+ * @brief Trace-driven cache simulator: replays requests through the
+ *        proxy's own cache to compare sizes and policies offline
+ *
+ * Each line of the trace names a URL (its first field containing "://")
+ * and optionally the size of the response in bytes (the next field that
+ * is all digits; -b otherwise). Other fields are ignored, so a trace can
+ * be "url size", "timestamp url size" or the proxy's access log. Keys are
+ * made by key_from_url() exactly as the proxy makes them, with -q and -i
+ * meaning what they mean to the proxy.
+ *
+ * For every -m size and -p policy the trace is replayed through a fresh
+ * private cache (cache_create() without a memfd), with no sockets in the
+ * way: a hit is find() and, under LRU, move_to_front(); a miss is
+ * cache_URL() of an object of the traced size, evicting as the proxy
+ * would. Each run reports the hit ratio, byte hit ratio, evictions and
+ * replay speed; -j prints each as a JSON line.
+ *
+ * usage: cachesim -f trace [-m 1M,16M,256M] [-p lru,fifo] [-o max_object_size]
+ *                 [-s shards] [-b default_size] [-q] [-i param]... [-j]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include "../cache.h"
+#include "../config.h"
+#include "../key.h"
+
+#define MAX_LINE 16384
+#define MAX_RUNS 64
+#define DEFAULT_SIZES "256K,1M,4M,16M,64M"
+#define DEFAULT_OBJECT_SIZE 1024
+
+/* One line of the trace */
+typedef struct
+{
+    uint32_t object; /* index into objects */
+    uint32_t size;   /* bytes of the response */
+} Access;
+
+static Access *accesses = NULL;
+static long naccesses = 0;
+
+/* Distinct keys, each allocated only as long as its bytes, so that a
+ * trace of millions of requests fits in memory */
+static CacheKey **objects = NULL;
+static long nobjects = 0, objects_cap = 0;
+static long *object_table = NULL; /* open addressing on the hash, -1 free */
+static long table_size = 0;
+
+static KeyOptions key_options;
+static size_t max_object_size = CONFIG_MAX_OBJECT_SIZE;
+static long default_size = DEFAULT_OBJECT_SIZE;
+static int nshards = 1;
+static int json = 0;
+
+static void out_of_memory(void)
+{
+    fprintf(stderr, "cachesim: out of memory after %ld requests for %ld objects\n",
+            naccesses, nobjects);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void grow_table(void)
+{
+    long size = table_size ? table_size * 2 : 1 << 16;
+
+    free(object_table);
+    if ((object_table = malloc(sizeof(long) * size)) == NULL)
+        out_of_memory();
+    memset(object_table, 0xff, sizeof(long) * size);
+    table_size = size;
+    for (long i = 0; i < nobjects; i++)
+    {
+        long slot = objects[i]->hash & (size - 1);
+        while (object_table[slot] != -1)
+            slot = (slot + 1) & (size - 1);
+        object_table[slot] = i;
+    }
+}
+
+/** @brief The index of key among the objects, adding it if it is new */
+static long intern(const CacheKey *key)
+{
+    long slot;
+    CacheKey *copy;
+
+    if (nobjects * 2 >= table_size)
+        grow_table();
+    for (slot = key->hash & (table_size - 1); object_table[slot] != -1;
+         slot = (slot + 1) & (table_size - 1))
+    {
+        CacheKey *other = objects[object_table[slot]];
+        if (other->hash == key->hash && other->len == key->len &&
+            memcmp(other->data, key->data, key->len) == 0)
+            return object_table[slot];
+    }
+    if (nobjects == objects_cap)
+    {
+        CacheKey **grown;
+
+        objects_cap = objects_cap ? objects_cap * 2 : 1024;
+        if ((grown = realloc(objects, sizeof(CacheKey *) * objects_cap)) == NULL)
+            out_of_memory();
+        objects = grown;
+    }
+    if ((copy = malloc(offsetof(CacheKey, data) + key->len)) == NULL)
+        out_of_memory();
+    memcpy(copy, key, offsetof(CacheKey, data) + key->len);
+    objects[nobjects] = copy;
+    object_table[slot] = nobjects;
+    return nobjects++;
+}
+
+/**
+ * @brief Split an absolute URL as the proxy does and make its key
+ *
+ * @return 0, or -1 if the URL isn't http://host[:port]/path
+ */
+static int url_key(const char *url, CacheKey *key)
+{
+    char host[1024], port[16] = "80";
+    const char *p, *path;
+    size_t n;
+
+    if (strncasecmp(url, "http://", 7) != 0)
+        return -1;
+    url += 7;
+    n = strcspn(url, ":/");
+    if (n == 0 || n >= sizeof(host))
+        return -1;
+    memcpy(host, url, n);
+    host[n] = '\0';
+    p = url + n;
+    if (*p == ':')
+    {
+        n = strcspn(++p, "/");
+        if (n == 0 || n >= sizeof(port))
+            return -1;
+        memcpy(port, p, n);
+        port[n] = '\0';
+        p += n;
+    }
+    path = *p == '/' ? p + 1 : p;
+    return key_from_url(key, host, port, path, &key_options);
+}
+
+/** @brief Read the trace into accesses, interning its keys */
+static int load_trace(const char *path)
+{
+    static CacheKey key;
+    char line[MAX_LINE], *field, *url, *save;
+    long cap = 0, size;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (line[0] == '#')
+            continue;
+        url = NULL;
+        size = default_size;
+        for (field = strtok_r(line, " \t\r\n", &save); field != NULL;
+             field = strtok_r(NULL, " \t\r\n", &save))
+        {
+            if (url == NULL && strstr(field, "://") != NULL)
+                url = field;
+            else if (url != NULL && field[strspn(field, "0123456789")] == '\0')
+            {
+                size = atol(field);
+                break;
+            }
+        }
+        if (url == NULL || url_key(url, &key) < 0)
+            continue;
+        if (naccesses == cap)
+        {
+            Access *grown;
+
+            cap = cap ? cap * 2 : 1 << 16;
+            if ((grown = realloc(accesses, sizeof(Access) * cap)) == NULL)
+                out_of_memory();
+            accesses = grown;
+        }
+        accesses[naccesses].object = intern(&key);
+        accesses[naccesses].size = size > UINT32_MAX ? UINT32_MAX : size;
+        naccesses++;
+    }
+    fclose(fp);
+    return naccesses > 0 ? 0 : -1;
+}
+
+/** @brief Replay the trace through a cache of this size and policy */
+static void replay(size_t cache_size, int policy, const char *policy_name)
+{
+    static char *payload = NULL;
+    CacheMeta meta;
+    CacheStats stats;
+    CacheList *cache;
+    long hits = 0;
+    size_t bytes = 0, hit_bytes = 0;
+    double start, elapsed;
+
+    if (payload == NULL && (payload = calloc(1, max_object_size)) == NULL)
+        out_of_memory();
+    if ((cache = cache_create(cache_size, nshards, NULL)) == NULL)
+    {
+        fprintf(stderr, "cachesim: can't map a %zu-byte cache\n", cache_size);
+        return;
+    }
+    cache_configure(cache, cache_size, max_object_size, policy);
+    memset(&meta, 0, sizeof(meta));
+
+    start = now();
+    for (long i = 0; i < naccesses; i++)
+    {
+        const CacheKey *key = objects[accesses[i].object];
+        CacheList *shard = cache_shard(cache, key->hash);
+        int hit;
+
+        bytes += accesses[i].size;
+        cache_lock(shard);
+        if ((hit = find(key, shard) != NULL) && policy == CACHE_LRU)
+            move_to_front(key, shard);
+        cache_unlock(shard);
+        if (hit)
+        {
+            hits++;
+            hit_bytes += accesses[i].size;
+        }
+        else if (accesses[i].size <= max_object_size)
+            cache_URL(key, payload, accesses[i].size, &meta, cache);
+    }
+    elapsed = now() - start;
+    cache_stats(cache, &stats);
+    cache_destruct(cache);
+
+    if (json)
+        printf("{\"policy\":\"%s\",\"cache_size\":%zu,\"requests\":%ld,\"objects\":%ld,"
+               "\"hit_ratio\":%.4f,\"byte_hit_ratio\":%.4f,\"evictions\":%lu,"
+               "\"insertions\":%lu,\"mrps\":%.2f}\n",
+               policy_name, cache_size, naccesses, nobjects, (double)hits / naccesses,
+               bytes ? (double)hit_bytes / bytes : 0, (unsigned long)stats.evictions,
+               (unsigned long)stats.insertions, naccesses / elapsed / 1e6);
+    else
+        printf("%-5s %12zu %9.2f%% %9.2f%% %12lu %10.2f\n", policy_name, cache_size,
+               100.0 * hits / naccesses, bytes ? 100.0 * hit_bytes / bytes : 0,
+               (unsigned long)stats.evictions, naccesses / elapsed / 1e6);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -f trace [-m size,...] [-p lru|fifo,...] [-o max_object_size]\n"
+            "          [-s shards] [-b default_size] [-q] [-i param]... [-j]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char default_sizes[] = DEFAULT_SIZES, default_policies[] = "lru,fifo";
+    char *trace = NULL, *sizes = default_sizes, *policies = default_policies, *token, *save;
+    Config cfg;
+    size_t cache_sizes[MAX_RUNS];
+    int policy_ids[MAX_RUNS];
+    const char *names[MAX_RUNS];
+    int opt, nsizes = 0, npolicies = 0;
+
+    config_defaults(&cfg);
+    while ((opt = getopt(argc, argv, "f:m:p:o:s:b:qi:j")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            trace = optarg;
+            break;
+        case 'm':
+            sizes = optarg;
+            break;
+        case 'p':
+            policies = optarg;
+            break;
+        case 'o':
+            if (config_set(&cfg, "max_object_size", optarg) < 0)
+                usage(argv[0]);
+            max_object_size = cfg.max_object_size;
+            break;
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 'b':
+            default_size = atol(optarg);
+            break;
+        case 'q':
+            key_options.sort_query = 1;
+            break;
+        case 'i':
+            if (key_options.nignored == KEY_MAX_IGNORED)
+                usage(argv[0]);
+            key_options.ignored[key_options.nignored++] = optarg;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (trace == NULL || optind != argc || nshards < 1 || nshards > CONFIG_MAX_SHARDS ||
+        default_size < 0)
+        usage(argv[0]);
+
+    /** sizes and policies are parsed as the config file parses them */
+    for (token = strtok_r(sizes, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        if (nsizes == MAX_RUNS || config_set(&cfg, "cache_size", token) < 0 || cfg.cache_size == 0)
+            usage(argv[0]);
+        cache_sizes[nsizes++] = cfg.cache_size;
+    }
+    for (token = strtok_r(policies, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        if (npolicies == MAX_RUNS || config_set(&cfg, "policy", token) < 0)
+            usage(argv[0]);
+        policy_ids[npolicies] = cfg.policy;
+        names[npolicies++] = token;
+    }
+    if (nsizes == 0 || npolicies == 0)
+        usage(argv[0]);
+
+    if (load_trace(trace) < 0)
+    {
+        fprintf(stderr, "%s: no http:// URLs in %s\n", argv[0], trace);
+        exit(1);
+    }
+    if (!json)
+    {
+        printf("%ld requests for %ld objects\n", naccesses, nobjects);
+        printf("%-5s %12s %10s %10s %12s %10s\n", "policy", "cache_size", "hits",
+               "byte_hits", "evictions", "Mreq/s");
+    }
+    for (int p = 0; p < npolicies; p++)
+        for (int s = 0; s < nsizes; s++)
+            replay(cache_sizes[s], policy_ids[p], names[p]);
+    return 0;
+}
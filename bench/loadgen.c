@@ -0,0 +1,568 @@
+/**
+ * @file loadgen.c
+ * @brief Load generator for the proxy: closed or open loop, reporting
+ *        throughput, latency percentiles, errors and the cache hit ratio
+ *
+ * Each of -c threads keeps one connection busy. In a closed loop (the
+ * default) a thread sends its next request as soon as the last one is
+ * answered; with -r the threads share a fixed arrival rate instead, and
+ * latency is counted from when each request was due, so a stalled proxy
+ * can't hide its queueing delay (coordinated omission).
+ *
+ * URLs come from a trace file (-f, one per line, requested in turn) or
+ * from a template (-u) whose %d is replaced by an object number drawn
+ * from a Zipf distribution over -N objects with exponent -s. Requests go
+ * through the proxy given with -x, or straight to the origin without it.
+ * The hit ratio is the change in the proxy's /metrics counters over the
+ * run.
+ *
+ * usage: loadgen -x localhost:15213 -u 'http://localhost:8000/cgi-bin/adder?%d&1'
+ *                [-c conns] [-n requests | -d seconds] [-r rate] [-k]
+ *                [-N objects] [-s exponent] [-f trace] [-j]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define MAX_THREADS 1024
+#define MAX_URL 2048
+#define BUF_SIZE 65536
+/* Seconds a request may take before it counts as an error */
+#define REQUEST_TIMEOUT 10
+
+typedef struct
+{
+    char host[256];
+    char port[16];
+} Address;
+
+/* Settings, from the command line */
+static Address proxy;           /* where requests go: the proxy, or the origin */
+static int use_proxy = 0;       /* -x given: send absolute URLs */
+static const char *url_template = NULL;
+static char **trace_urls = NULL; /* -f */
+static long ntrace = 0;
+static int nthreads = 8;
+static long total_requests = 1000; /* 0 with -d */
+static double duration = 0;       /* seconds, or 0 */
+static double rate = 0;           /* requests per second, or 0 for a closed loop */
+static int keep_alive = 0;
+static long nobjects = 1000;
+static double zipf_s = 1.0;
+static int json = 0;
+
+/* Zipf distribution over the objects, as a CDF */
+static double *zipf_cdf = NULL;
+
+/* Shared progress */
+static atomic_long issued = 0;
+static double start_time;
+
+typedef struct
+{
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    long *latencies; /* microseconds, one per completed request */
+    long nlatencies, cap;
+    long errors;
+    long bytes;
+    long status[6]; /* by first digit */
+} Worker;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** @brief xorshift64*: fast, and good enough to pick URLs */
+static double uniform(Worker *w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return ((w->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void build_zipf(void)
+{
+    double sum = 0;
+
+    zipf_cdf = malloc(sizeof(double) * nobjects);
+    for (long i = 0; i < nobjects; i++)
+        zipf_cdf[i] = (sum += 1.0 / pow(i + 1, zipf_s));
+    for (long i = 0; i < nobjects; i++)
+        zipf_cdf[i] /= sum;
+}
+
+/** @brief Object number (from 0, most popular first) for a uniform draw u */
+static long zipf_pick(double u)
+{
+    long lo = 0, hi = nobjects - 1;
+
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief The n'th URL to request
+ */
+static void next_url(Worker *w, long n, char *url)
+{
+    if (trace_urls != NULL)
+        snprintf(url, MAX_URL, "%s", trace_urls[n % ntrace]);
+    else
+        snprintf(url, MAX_URL, url_template, zipf_pick(uniform(w)));
+}
+
+static int parse_address(const char *s, Address *addr)
+{
+    const char *colon = strrchr(s, ':');
+
+    if (colon == NULL || colon == s || (size_t)(colon - s) >= sizeof(addr->host) ||
+        strlen(colon + 1) >= sizeof(addr->port))
+        return -1;
+    memcpy(addr->host, s, colon - s);
+    addr->host[colon - s] = '\0';
+    strcpy(addr->port, colon + 1);
+    return 0;
+}
+
+/**
+ * @brief Split http://host[:port]/path into its address and path
+ */
+static int split_url(const char *url, Address *addr, const char **path)
+{
+    const char *host = url, *end;
+    size_t len;
+
+    if (strncasecmp(url, "http://", 7) == 0)
+        host += 7;
+    end = host + strcspn(host, ":/");
+    len = end - host;
+    if (len == 0 || len >= sizeof(addr->host))
+        return -1;
+    memcpy(addr->host, host, len);
+    addr->host[len] = '\0';
+    strcpy(addr->port, "80");
+    if (*end == ':')
+    {
+        size_t plen = strcspn(end + 1, "/");
+        if (plen == 0 || plen >= sizeof(addr->port))
+            return -1;
+        memcpy(addr->port, end + 1, plen);
+        addr->port[plen] = '\0';
+        end += 1 + plen;
+    }
+    *path = *end == '\0' ? "/" : end;
+    return 0;
+}
+
+static int connect_to(const Address *addr)
+{
+    struct addrinfo hints, *list, *p;
+    struct timeval tv = {REQUEST_TIMEOUT, 0};
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(addr->host, addr->port, &hints, &list) != 0)
+        return -1;
+    for (p = list; p != NULL; p = p->ai_next)
+    {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    if (fd >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send one GET for url on *fd (connecting first if it is -1) and
+ *        read the whole response
+ *
+ * @param fd Left open if the response allows the connection to be reused
+ * @param status Set to the status code
+ * @return Bytes of response read, or -1 on an error
+ */
+static long fetch(int *fd, const char *url, int *status)
+{
+    char request[MAX_URL + 256], buf[BUF_SIZE];
+    Address origin;
+    const char *path;
+    size_t got = 0, header_len = 0;
+    long length = -1, total;
+    int reusable = 0;
+    ssize_t n;
+    char *end;
+
+    if (split_url(url, &origin, &path) < 0)
+        return -1;
+    snprintf(request, sizeof(request),
+             "GET %s HTTP/1.1\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+             use_proxy ? url : path, origin.host, origin.port, keep_alive ? "keep-alive" : "close");
+    if (*fd < 0 && (*fd = connect_to(use_proxy ? &proxy : &origin)) < 0)
+        return -1;
+    if (write_all(*fd, request, strlen(request)) < 0)
+        goto fail;
+
+    /** headers */
+    while ((end = memmem(buf, got, "\r\n\r\n", 4)) == NULL)
+    {
+        if (got == sizeof(buf) || (n = read(*fd, buf + got, sizeof(buf) - got)) <= 0)
+            goto fail;
+        got += n;
+    }
+    header_len = end + 4 - buf;
+    if (sscanf(buf, "HTTP/%*d.%*d %d", status) != 1)
+        goto fail;
+    for (char *line = buf; line < end; line = strstr(line, "\r\n") + 2)
+    {
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = strtol(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+            reusable = strncasecmp(line + 11 + strspn(line + 11, " "), "keep-alive", 10) == 0;
+    }
+    if (strncmp(buf, "HTTP/1.1", 8) == 0)
+        reusable = reusable || memmem(buf, header_len, "onnection: close", 16) == NULL;
+
+    /** body: Content-Length bytes, or up to EOF */
+    total = got;
+    got -= header_len;
+    while (length < 0 || (long)got < length)
+    {
+        if ((n = read(*fd, buf, sizeof(buf))) < 0)
+            goto fail;
+        if (n == 0)
+        {
+            if (length >= 0)
+                goto fail; /* cut short */
+            break;
+        }
+        got += n;
+        total += n;
+    }
+    if (!keep_alive || !reusable || length < 0)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return total;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void record(Worker *w, long usec)
+{
+    if (w->nlatencies == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->latencies = realloc(w->latencies, sizeof(long) * w->cap);
+    }
+    w->latencies[w->nlatencies++] = usec;
+}
+
+static void sleep_until(double t)
+{
+    double d = t - now();
+    struct timespec ts;
+
+    if (d <= 0)
+        return;
+    ts.tv_sec = (time_t)d;
+    ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static void *run(void *vargp)
+{
+    Worker *w = vargp;
+    char url[MAX_URL];
+    int fd = -1, status;
+
+    while (1)
+    {
+        long n = atomic_fetch_add(&issued, 1);
+        double due = now();
+        long bytes;
+
+        if (total_requests > 0 && n >= total_requests)
+            break;
+        if (duration > 0 && due - start_time >= duration)
+            break;
+        if (rate > 0)
+        {
+            /** open loop: request n is due at n / rate, late or not */
+            due = start_time + n / rate;
+            sleep_until(due);
+            if (duration > 0 && due - start_time >= duration)
+                break;
+        }
+        next_url(w, n, url);
+        if ((bytes = fetch(&fd, url, &status)) < 0)
+        {
+            w->errors++;
+            continue;
+        }
+        w->bytes += bytes;
+        w->status[status / 100 <= 5 ? status / 100 : 0]++;
+        if (status >= 400)
+            w->errors++;
+        record(w, (long)((now() - due) * 1e6));
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Read the proxy's hit and miss counters from its /metrics page
+ *
+ * @return 0 on success, -1 if there are none (no proxy, or an older one)
+ */
+static int read_metrics(double *hits, double *misses)
+{
+    static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    char buf[BUF_SIZE], *p;
+    size_t got = 0;
+    ssize_t n;
+    int fd;
+
+    if (!use_proxy || (fd = connect_to(&proxy)) < 0)
+        return -1;
+    if (write_all(fd, request, strlen(request)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    while (got < sizeof(buf) - 1 && (n = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0)
+        got += n;
+    close(fd);
+    buf[got] = '\0';
+    if ((p = strstr(buf, "\nproxy_cache_hits_total ")) == NULL)
+        return -1;
+    *hits = strtod(p + 24, NULL);
+    if ((p = strstr(buf, "\nproxy_cache_misses_total ")) == NULL)
+        return -1;
+    *misses = strtod(p + 26, NULL);
+    return 0;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static long percentile(long *sorted, long n, double p)
+{
+    long i;
+
+    if (n == 0)
+        return 0;
+    i = (long)ceil(p / 100 * n) - 1;
+    return sorted[i < 0 ? 0 : i >= n ? n - 1 : i];
+}
+
+static int load_trace(const char *path)
+{
+    char line[MAX_URL];
+    long cap = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (ntrace == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            trace_urls = realloc(trace_urls, sizeof(char *) * cap);
+        }
+        trace_urls[ntrace++] = strdup(line);
+    }
+    fclose(fp);
+    return ntrace > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-x proxy_host:port] (-u url_template | -f trace_file)\n"
+            "          [-c conns] [-n requests | -d seconds] [-r rate] [-k]\n"
+            "          [-N objects] [-s zipf_exponent] [-j]\n"
+            "  url_template: %%d is replaced by a Zipf-distributed object number\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static Worker workers[MAX_THREADS];
+    double hits0 = 0, misses0 = 0, hits1, misses1, elapsed, hit_ratio = -1;
+    long completed = 0, errors = 0, bytes = 0, status[6] = {0}, *all;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:u:f:c:n:d:r:kN:s:j")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            if (parse_address(optarg, &proxy) < 0)
+                usage(argv[0]);
+            use_proxy = 1;
+            break;
+        case 'u':
+            url_template = optarg;
+            break;
+        case 'f':
+            if (load_trace(optarg) < 0)
+            {
+                fprintf(stderr, "%s: no URLs in %s\n", argv[0], optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            total_requests = atol(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            total_requests = 0;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'N':
+            nobjects = atol(optarg);
+            break;
+        case 's':
+            zipf_s = atof(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((url_template == NULL) == (trace_urls == NULL) || nthreads < 1 || nthreads > MAX_THREADS ||
+        nobjects < 1 || (total_requests <= 0 && duration <= 0))
+        usage(argv[0]);
+    if (trace_urls == NULL)
+        build_zipf();
+
+    read_metrics(&hits0, &misses0);
+    start_time = now();
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (uint64_t)time(NULL);
+        pthread_create(&workers[i].tid, NULL, run, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(workers[i].tid, NULL);
+    elapsed = now() - start_time;
+    if (read_metrics(&hits1, &misses1) == 0 && hits1 + misses1 > hits0 + misses0)
+        hit_ratio = (hits1 - hits0) / (hits1 - hits0 + misses1 - misses0);
+
+    for (int i = 0; i < nthreads; i++)
+        completed += workers[i].nlatencies;
+    all = malloc(sizeof(long) * (completed ? completed : 1));
+    completed = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        memcpy(all + completed, workers[i].latencies, sizeof(long) * workers[i].nlatencies);
+        completed += workers[i].nlatencies;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        for (int s = 0; s < 6; s++)
+            status[s] += workers[i].status[s];
+    }
+    qsort(all, completed, sizeof(long), compare_long);
+
+    if (json)
+    {
+        printf("{\"requests\":%ld,\"errors\":%ld,\"seconds\":%.3f,\"rps\":%.1f,\"mbps\":%.2f,"
+               "\"p50_us\":%ld,\"p90_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld,\"max_us\":%ld,"
+               "\"hit_ratio\":%.4f}\n",
+               completed, errors, elapsed, completed / elapsed, bytes * 8 / elapsed / 1e6,
+               percentile(all, completed, 50), percentile(all, completed, 90),
+               percentile(all, completed, 99), percentile(all, completed, 99.9),
+               completed ? all[completed - 1] : 0, hit_ratio);
+    }
+    else
+    {
+        printf("%ld requests in %.2f s over %d connections (%s loop)\n", completed, elapsed,
+               nthreads, rate > 0 ? "open" : "closed");
+        printf("throughput: %.1f req/s, %.2f Mbit/s\n", completed / elapsed, bytes * 8 / elapsed / 1e6);
+        printf("latency (us): p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+               percentile(all, completed, 50), percentile(all, completed, 90),
+               percentile(all, completed, 99), percentile(all, completed, 99.9),
+               completed ? all[completed - 1] : 0);
+        printf("status: 2xx %ld  3xx %ld  4xx %ld  5xx %ld;  errors %ld\n", status[2], status[3],
+               status[4], status[5], errors);
+        if (hit_ratio >= 0)
+            printf("hit ratio: %.1f%%\n", hit_ratio * 100);
+    }
+    return errors > 0 && completed == 0;
+}
@@ -0,0 +1,422 @@
+/**
+ * @file microbench.c
+ * @brief Microbenchmarks for the proxy's inner loops: request parsing and
+ *        assembly, cache lookups and inserts, and buffered reads
+ *
+ * proxy.c is compiled in whole (its main() renamed), so the benchmarks call
+ * the very functions the proxy runs, static types and all, built with the
+ * proxy's own CFLAGS. Each benchmark runs its operation in a loop, growing
+ * the count until a run takes at least -t seconds, and reports the time and
+ * the heap allocations per operation; malloc() and friends are interposed
+ * here to count them, allocations made inside libc (strdup) included.
+ *
+ * The cache benchmarks run at several populations (objects cached), since
+ * the cost of a lookup depends on how full the hash index is.
+ *
+ * usage: microbench [-t seconds] [-j] [name...]
+ *   name: run only the benchmarks whose names start with one of these
+ *   -j: one JSON object per benchmark per line, for comparing runs
+ */
+
+#define main proxy_main
+#include "../proxy.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_TARGET 0.2         /* seconds a measured run must last */
+#define BENCH_MAX_ITERATIONS (1L << 30)
+#define OBJECT_SIZE 1024         /* bytes of each object in the cache benchmarks */
+#define READ_SIZE (64 * 1024)    /* bytes read per operation by the rio benchmarks */
+
+/* Heap activity on this thread, from the interposed allocator */
+static __thread long alloc_count = 0;
+static __thread long alloc_bytes = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*setup)(long arg); /* untimed, before the benchmark; may be NULL */
+    void (*op)(long i);      /* the operation; i counts up from 0 */
+    long arg;                /* for setup, e.g. the cache population */
+} Benchmark;
+
+static double bench_target = BENCH_TARGET;
+static int json = 0;
+
+static const char *request_line = "GET http://localhost:8000/cgi-bin/adder?15213&18213 HTTP/1.1\r\n";
+static const char *request_headers[] = {
+    "Host: localhost:8000",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+    "Accept-Language: en-US,en;q=0.5",
+    "Accept-Encoding: gzip, deflate",
+    "Connection: keep-alive",
+    "Proxy-Connection: keep-alive",
+    "Cache-Control: max-age=0",
+};
+#define NHEADERS (int)(sizeof(request_headers) / sizeof(request_headers[0]))
+
+static Request bench_req;
+static struct iovec *bench_iov;
+static CacheList *bench_cache;
+static CacheKey **bench_keys;    /* keys of the cached population, then as many more */
+static long bench_population;
+static char bench_object[OBJECT_SIZE];
+static CacheMeta bench_meta;
+static int bench_fd = -1;        /* temporary file of header lines for the rio benchmarks */
+static char bench_buf[READ_SIZE];
+static volatile long bench_sink; /* keeps results from being optimized away */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Request parsing and assembly */
+
+static void setup_request(long arg)
+{
+    (void)arg;
+    config_defaults(&config);
+    free(bench_req.headers);
+    initialize_struct(&bench_req);
+    parse_request((char *)request_line, &bench_req);
+    for (int h = 0; h < NHEADERS; h++)
+        parse_header((char *)request_headers[h], &bench_req);
+    make_key(&bench_req);
+    add_headers(&bench_req);
+    free(bench_iov);
+    bench_iov = malloc(sizeof(struct iovec) * REQUEST_IOV(&bench_req));
+}
+
+static void op_parse_request(long i)
+{
+    (void)i;
+    parse_request((char *)request_line, &bench_req);
+}
+
+static void op_parse_header(long i)
+{
+    bench_req.num_headers = 0;
+    parse_header((char *)request_headers[i % NHEADERS], &bench_req);
+}
+
+static void op_make_key(long i)
+{
+    (void)i;
+    make_key(&bench_req);
+}
+
+static void op_assemble_request(long i)
+{
+    (void)i;
+    bench_sink += assemble_request(&bench_req, bench_iov);
+}
+
+/** @brief What handle_client() does with a request before it goes upstream */
+static void op_request(long i)
+{
+    Request *req = &bench_req;
+
+    (void)i;
+    free(req->headers);
+    initialize_struct(req);
+    parse_request((char *)request_line, req);
+    for (int h = 0; h < NHEADERS; h++)
+        parse_header((char *)request_headers[h], req);
+    make_key(req);
+    add_headers(req);
+    bench_sink += assemble_request(req, bench_iov);
+}
+
+/* The cache, at a population of arg objects */
+
+/** @brief Key n, allocated only as long as its bytes, as cachesim keeps them */
+static CacheKey *make_bench_key(long n)
+{
+    static CacheKey key;
+    char path[64];
+    CacheKey *copy;
+
+    snprintf(path, sizeof(path), "objects/%ld.html", n);
+    key_from_url(&key, "localhost", "8000", path, &key_options);
+    if ((copy = malloc(offsetof(CacheKey, data) + key.len)) != NULL)
+        memcpy(copy, &key, offsetof(CacheKey, data) + key.len);
+    return copy;
+}
+
+static void setup_cache(long population)
+{
+    size_t size = (size_t)(population + 1) * 2 * (OBJECT_SIZE + CACHE_BLOCK_SIZE);
+
+    if (bench_cache != NULL)
+        cache_destruct(bench_cache);
+    for (long n = 0; n < bench_population * 2; n++)
+        free(bench_keys[n]);
+    free(bench_keys);
+    bench_population = 0;
+    if ((bench_keys = calloc(population * 2, sizeof(CacheKey *))) == NULL ||
+        (bench_cache = cache_create(size, 1, NULL)) == NULL)
+    {
+        fprintf(stderr, "microbench: no memory for a cache of %ld objects\n", population);
+        exit(1);
+    }
+    cache_configure(bench_cache, size / 2, OBJECT_SIZE, CACHE_LRU);
+    bench_population = population;
+    for (long n = 0; n < population * 2; n++)
+    {
+        if ((bench_keys[n] = make_bench_key(n)) == NULL)
+        {
+            fprintf(stderr, "microbench: no memory for %ld keys\n", population * 2);
+            exit(1);
+        }
+    }
+    for (long n = 0; n < population; n++)
+        cache_URL(bench_keys[n], bench_object, OBJECT_SIZE, &bench_meta, bench_cache);
+}
+
+static void op_find_hit(long i)
+{
+    cache_lock(bench_cache);
+    bench_sink += find(bench_keys[i % bench_population], bench_cache) != NULL;
+    cache_unlock(bench_cache);
+}
+
+static void op_find_miss(long i)
+{
+    cache_lock(bench_cache);
+    bench_sink += find(bench_keys[bench_population + i % bench_population], bench_cache) != NULL;
+    cache_unlock(bench_cache);
+}
+
+static void op_move_to_front(long i)
+{
+    cache_lock(bench_cache);
+    move_to_front(bench_keys[i % bench_population], bench_cache);
+    cache_unlock(bench_cache);
+}
+
+static void op_cache_get(long i)
+{
+    void *item;
+
+    if (cache_get(bench_keys[i % bench_population], &item, &bench_meta, bench_cache) >= 0)
+        free(item);
+}
+
+/** @brief Insert into a full cache: every insert evicts the oldest object */
+static void op_cache_url(long i)
+{
+    cache_URL(bench_keys[(bench_population + i) % (bench_population * 2)], bench_object,
+              OBJECT_SIZE, &bench_meta, bench_cache);
+}
+
+/** @brief A cache with room for exactly its population */
+static void setup_full_cache(long population)
+{
+    size_t blocks;
+
+    setup_cache(population);
+    blocks = (OBJECT_SIZE + bench_keys[0]->len + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    cache_configure(bench_cache, population * blocks * CACHE_BLOCK_SIZE, OBJECT_SIZE, CACHE_LRU);
+}
+
+/* Buffered reads of READ_SIZE bytes of header lines */
+
+static void setup_read(long arg)
+{
+    int len = 0;
+    FILE *fp;
+
+    (void)arg;
+    if (bench_fd >= 0)
+        return;
+    for (int h = 0; len < READ_SIZE; h++)
+    {
+        int n = snprintf(bench_buf + len, READ_SIZE - len, "%s\r\n",
+                         request_headers[h % NHEADERS]);
+        len += n < READ_SIZE - len ? n : READ_SIZE - len;
+    }
+    if ((fp = tmpfile()) == NULL || fwrite(bench_buf, 1, READ_SIZE, fp) != READ_SIZE ||
+        fflush(fp) != 0)
+    {
+        perror("microbench: tmpfile");
+        exit(1);
+    }
+    bench_fd = fileno(fp);
+}
+
+static void op_rio_readlineb(long i)
+{
+    char line[MAXLINE];
+    rio_t rio;
+    ssize_t n;
+
+    (void)i;
+    lseek(bench_fd, 0, SEEK_SET);
+    rio_readinitb(&rio, bench_fd);
+    while ((n = rio_readlineb(&rio, line, MAXLINE)) > 0)
+        bench_sink += n;
+}
+
+static void op_rio_readnb(long i)
+{
+    rio_t rio;
+    ssize_t n;
+
+    (void)i;
+    lseek(bench_fd, 0, SEEK_SET);
+    rio_readinitb(&rio, bench_fd);
+    while ((n = rio_readnb(&rio, bench_buf, MAXBUF)) > 0)
+        bench_sink += n;
+}
+
+static void op_read(long i)
+{
+    ssize_t n;
+
+    (void)i;
+    lseek(bench_fd, 0, SEEK_SET);
+    while ((n = read(bench_fd, bench_buf, READ_SIZE)) > 0)
+        bench_sink += n;
+}
+
+static const Benchmark benchmarks[] = {
+    {"parse_request", setup_request, op_parse_request, 0},
+    {"parse_header", setup_request, op_parse_header, 0},
+    {"make_key", setup_request, op_make_key, 0},
+    {"assemble_request", setup_request, op_assemble_request, 0},
+    {"request", setup_request, op_request, 0},
+    {"find_hit/1000", setup_cache, op_find_hit, 1000},
+    {"find_hit/100000", setup_cache, op_find_hit, 100000},
+    {"find_miss/1000", setup_cache, op_find_miss, 1000},
+    {"find_miss/100000", setup_cache, op_find_miss, 100000},
+    {"move_to_front/1000", setup_cache, op_move_to_front, 1000},
+    {"move_to_front/100000", setup_cache, op_move_to_front, 100000},
+    {"cache_get/1000", setup_cache, op_cache_get, 1000},
+    {"cache_get/100000", setup_cache, op_cache_get, 100000},
+    {"cache_URL/1000", setup_full_cache, op_cache_url, 1000},
+    {"cache_URL/100000", setup_full_cache, op_cache_url, 100000},
+    {"rio_readlineb/64K", setup_read, op_rio_readlineb, 0},
+    {"rio_readnb/64K", setup_read, op_rio_readnb, 0},
+    {"read/64K", setup_read, op_read, 0},
+};
+#define NBENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/**
+ * @brief Time b, growing the iterations until a run lasts bench_target
+ */
+static void run(const Benchmark *b)
+{
+    long iterations = 1, allocs, bytes;
+    double elapsed;
+
+    if (b->setup != NULL)
+        b->setup(b->arg);
+    while (1)
+    {
+        double start;
+
+        allocs = alloc_count;
+        bytes = alloc_bytes;
+        start = now();
+        for (long i = 0; i < iterations; i++)
+            b->op(i);
+        elapsed = now() - start;
+        allocs = alloc_count - allocs;
+        bytes = alloc_bytes - bytes;
+        if (elapsed >= bench_target || iterations >= BENCH_MAX_ITERATIONS)
+            break;
+        /** aim a little past the target rather than doubling blindly */
+        if (elapsed > bench_target / 100)
+            iterations = (long)(iterations * bench_target * 1.2 / elapsed) + 1;
+        else
+            iterations *= 100;
+    }
+
+    if (json)
+        printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.2f,"
+               "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}\n",
+               b->name, iterations, elapsed * 1e9 / iterations,
+               (double)allocs / iterations, (double)bytes / iterations);
+    else
+        printf("%-24s %12ld %12.1f ns/op %8.2f allocs/op %10.1f B/op\n", b->name,
+               iterations, elapsed * 1e9 / iterations, (double)allocs / iterations,
+               (double)bytes / iterations);
+    fflush(stdout);
+}
+
+static int selected(const char *name, int argc, char **argv)
+{
+    if (optind == argc)
+        return 1;
+    for (int i = optind; i < argc; i++)
+    {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:j")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            bench_target = atof(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-j] [name...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    log_level = LOG_LEVEL_ERROR;
+    for (int i = 0; i < NBENCHMARKS; i++)
+    {
+        if (selected(benchmarks[i].name, argc, argv))
+            run(&benchmarks[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,211 @@
+#!/usr/bin/python3
+
+# perfcheck.py - Performance regression gate. Builds a baseline revision
+#                (HEAD by default) next to the working tree, then runs the
+#                load test (each proxy in front of the same "tiny -b",
+#                driven by bench/loadgen) and the microbenchmarks on both,
+#                interleaved: A B, B A, A B, ... Each load run is cut into
+#                slices of SLICE seconds, alternating between the builds.
+#
+#                Baseline and current runs share one session, so whatever
+#                differs between sessions (other load on the machine, CPU
+#                frequency, caches) falls on both alike. Each slice or run
+#                of the current build is paired with the baseline's next to
+#                it, and a metric regresses when the median of the paired
+#                relative changes is worse than the threshold and its 95%
+#                bootstrap confidence interval excludes zero. The gate is
+#                on the load test: throughput (rps) should not fall and p99
+#                latency should not rise. The microbenchmarks are reported
+#                the same way but don't fail the gate: there are a score of
+#                them, each noisier than the load test, so some would look
+#                worse on any run of an unchanged tree.
+#
+#                The samples of both builds are stored in --output.
+#                Everything runs on localhost, so no network is needed.
+#
+# usage: perfcheck.py [--against rev] [--runs n] [--duration seconds]
+#                     [--threshold fraction] [--output file]
+#
+import argparse
+import json
+import os
+import random
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+URL = "http://localhost:%d/synth?size=4096&maxage=600&n=%%d"
+
+# Metric name -> +1 if higher is better, -1 if lower is better
+LOAD_METRICS = {"rps": 1, "p99_us": -1}
+
+# Seconds of load per build before switching to the other one: short, so
+# that many pairs see the same conditions
+SLICE = 0.25
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("localhost", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_for(port, proc):
+    for _ in range(100):
+        if proc.poll() is not None:
+            sys.exit("perfcheck: %s exited" % proc.args[0])
+        try:
+            socket.create_connection(("localhost", port), 0.1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit("perfcheck: nothing listening on port %d" % port)
+
+
+def run_json(cmd, cwd=ROOT):
+    out = subprocess.run(cmd, cwd=cwd, check=True, stdout=subprocess.PIPE,
+                         universal_newlines=True).stdout
+    return [json.loads(line) for line in out.splitlines() if line.startswith("{")]
+
+
+def build_baseline(rev, tree):
+    """Export rev into tree and build its proxy (and microbench, if it has one)"""
+    archive = subprocess.Popen(["git", "archive", rev], cwd=ROOT, stdout=subprocess.PIPE)
+    subprocess.run(["tar", "-x", "-C", tree], stdin=archive.stdout, check=True)
+    if archive.wait() != 0:
+        sys.exit("perfcheck: can't export %s" % rev)
+    # the tree may hold committed build outputs as old as its sources
+    make = ["make", "-s", "-C", tree]
+    subprocess.run(make + ["clean"], check=True, stdout=subprocess.DEVNULL)
+    subprocess.run(make + ["proxy"], check=True, stdout=subprocess.DEVNULL)
+    if subprocess.run(make + ["bench/microbench"], stdout=subprocess.DEVNULL,
+                      stderr=subprocess.DEVNULL).returncode != 0:
+        print("perfcheck: %s has no microbenchmarks, comparing the load test only" % rev,
+              file=sys.stderr)
+
+
+def load_run(port, tiny_port, duration):
+    return run_json(["bench/loadgen", "-x", "localhost:%d" % port, "-u", URL % tiny_port,
+                     "-N", "1000", "-c", "16", "-d", str(duration), "-j"])[0]
+
+
+def measure(args, trees):
+    """Samples of each tree, as {tree: {metric: [one per run]}}"""
+    samples = {tree: {} for tree in trees}
+    tiny_port = free_port()
+    ports = {tree: free_port() for tree in trees}
+    procs = [subprocess.Popen(["./tiny", "-b", str(tiny_port)], cwd=os.path.join(ROOT, "tiny"),
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)]
+    try:
+        wait_for(tiny_port, procs[0])
+        for tree in trees:
+            procs.append(subprocess.Popen(["./proxy", str(ports[tree])], cwd=tree,
+                                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+            wait_for(ports[tree], procs[-1])
+            load_run(ports[tree], tiny_port, 1)  # fill its cache
+        slices = max(1, round(args.duration / SLICE))
+        for run in range(args.runs):
+            for s in range(slices):
+                # alternate which goes first, so drift within the session cancels out
+                for tree in trees if (run * slices + s) % 2 == 0 else trees[::-1]:
+                    load = load_run(ports[tree], tiny_port, args.duration / slices)
+                    for name in LOAD_METRICS:
+                        samples[tree].setdefault("load/" + name, []).append(load[name])
+            print("perfcheck: load run %d of %d" % (run + 1, args.runs), file=sys.stderr)
+    finally:
+        for proc in procs:
+            proc.kill()
+    # with the servers gone, so their threads don't share the CPU
+    for run in range(args.runs):
+        for tree in trees if run % 2 == 0 else trees[::-1]:
+            if not os.path.exists(os.path.join(tree, "bench", "microbench")):
+                continue
+            for bench in run_json(["bench/microbench", "-t", "0.1", "-j"], cwd=tree):
+                samples[tree].setdefault("micro/" + bench["name"], []).append(bench["ns_per_op"])
+        print("perfcheck: microbenchmark run %d of %d" % (run + 1, args.runs), file=sys.stderr)
+    return samples
+
+
+def direction(name):
+    if name.startswith("load/"):
+        return LOAD_METRICS[name[5:]]
+    return -1
+
+
+def median(xs):
+    xs = sorted(xs)
+    return (xs[(len(xs) - 1) // 2] + xs[len(xs) // 2]) / 2
+
+
+def change_interval(changes, resamples=2000):
+    """95% bootstrap confidence interval of the median paired change"""
+    rng = random.Random(15213)
+    medians = sorted(median(rng.choices(changes, k=len(changes))) for _ in range(resamples))
+    return medians[int(resamples * 0.025)], medians[int(resamples * 0.975) - 1]
+
+
+def compare(baseline, current, threshold, gated):
+    """Print the changes of the metrics named gated*; return how many regressed"""
+    regressions = 0
+    print("%-28s %12s %12s %8s %18s" % ("metric", "baseline", "current", "change", "95% CI"))
+    for name in sorted(current):
+        if name not in baseline or not name.startswith(gated):
+            continue
+        base, cur = baseline[name], current[name]
+        changes = [c / b - 1 for b, c in zip(base, cur) if b > 0]
+        if not changes:
+            continue
+        change = median(changes)
+        low, high = change_interval(changes)
+        worse = change * direction(name) < -threshold
+        significant = low > 0 if direction(name) < 0 else high < 0
+        verdict = "REGRESSED" if worse and significant and gated == "load/" else \
+            "worse" if worse and significant else ""
+        regressions += verdict == "REGRESSED"
+        print("%-28s %12.1f %12.1f %+7.1f%% [%+6.1f%%, %+6.1f%%] %s"
+              % (name, median(base), median(cur), 100 * change, 100 * low, 100 * high, verdict))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Performance regression gate")
+    parser.add_argument("--against", default="HEAD", help="baseline revision")
+    parser.add_argument("--runs", type=int, default=6)
+    parser.add_argument("--duration", type=float, default=3)
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="largest tolerated change for the worse, as a fraction")
+    parser.add_argument("--output", default=os.path.join(ROOT, "bench", "perf-results.json"),
+                        help="where the samples of both builds are stored")
+    args = parser.parse_args()
+    if args.runs < 2:
+        parser.error("--runs must be at least 2")
+
+    tree = tempfile.mkdtemp(prefix="perfcheck-")
+    try:
+        build_baseline(args.against, tree)
+        samples = measure(args, [tree, ROOT])
+    finally:
+        shutil.rmtree(tree, ignore_errors=True)
+    baseline, current = samples[tree], samples[ROOT]
+    with open(args.output, "w") as f:
+        json.dump({"baseline": baseline, "current": current, "against": args.against},
+                  f, indent=1, sort_keys=True)
+    regressions = compare(baseline, current, args.threshold, "load/")
+    print()
+    compare(baseline, current, args.threshold, "micro/")
+    if regressions:
+        print("perfcheck: %d metric(s) regressed by more than %.0f%% against %s"
+              % (regressions, 100 * args.threshold, args.against))
+        return 1
+    print("perfcheck: no regressions against %s" % args.against)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,756 @@
+/**
+ * @file cache.c
+ * @brief LRU web object cache living in one (optionally shared) memory region
+ *
+ * See cache.h for the region layout. find(), move_to_front() and evict()
+ * work on one shard, whose lock the caller holds; the other functions take
+ * the whole cache (any shard's CacheList will do), find the key's shard and
+ * take its lock themselves.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "probes.h"
+
+static inline int32_t *buckets(CacheList *list)
+{
+    return (int32_t *)((char *)list + list->buckets_off);
+}
+static inline CachedItem *entry(CacheList *list, int32_t i)
+{
+    return (CachedItem *)((char *)list + list->entries_off) + i;
+}
+static inline int32_t *block_next(CacheList *list)
+{
+    return (int32_t *)((char *)list + list->block_next_off);
+}
+static inline char *block(CacheList *list, int32_t b)
+{
+    return (char *)list + list->blocks_off + (size_t)b * CACHE_BLOCK_SIZE;
+}
+static inline int32_t entry_index(CacheList *list, CachedItem *item)
+{
+    return (int32_t)(item - entry(list, 0));
+}
+static inline int32_t blocks_for(size_t bytes)
+{
+    return (int32_t)((bytes + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE);
+}
+
+/** @brief 64-bit FNV-1a */
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Fill in key->hash from its bytes
+ */
+void cache_key_hash(CacheKey *key)
+{
+    key->hash = hash_key(key->data, key->len);
+}
+
+/**
+ * @brief Compute the layout of one shard holding max_size bytes
+ *
+ * @param layout Filled in with the array sizes and offsets
+ * @return The number of bytes of the shard
+ */
+static size_t cache_layout(size_t max_size, CacheList *layout)
+{
+    int32_t nblocks = blocks_for(max_size);
+    int32_t nbuckets = 1;
+    size_t off;
+
+    if (nblocks < 1)
+        nblocks = 1;
+    while (nbuckets < nblocks)
+        nbuckets <<= 1;
+    layout->nblocks = nblocks;
+    layout->nentries = nblocks; /* every object takes at least one block */
+    layout->nbuckets = nbuckets;
+
+    off = (sizeof(CacheList) + 63) & ~(size_t)63;
+    layout->buckets_off = off;
+    off += sizeof(int32_t) * nbuckets;
+    off = (off + 63) & ~(size_t)63;
+    layout->entries_off = off;
+    off += sizeof(CachedItem) * nblocks;
+    layout->block_next_off = off;
+    off += sizeof(int32_t) * nblocks;
+    off = (off + CACHE_BLOCK_SIZE - 1) & ~(size_t)(CACHE_BLOCK_SIZE - 1);
+    layout->blocks_off = off;
+    off += (size_t)nblocks * CACHE_BLOCK_SIZE;
+    layout->region_size = off;
+    return off;
+}
+
+/**
+ * @brief Map and format a new cache
+ *
+ * Its budget starts at the full capacity and no object is admitted until
+ * cache_configure() sets the limits.
+ *
+ * @param capacity The most bytes of block storage the cache can ever have;
+ *        the memory is reserved up front, the budget can grow up to it
+ * @param nshards The number of shards capacity is split across
+ * @param fd If not NULL, the cache is backed by a memfd that is shared
+ *        across fork() and can be passed to another process; the memfd
+ *        is stored here. If NULL, the cache is private to this process.
+ * @return The cache, or NULL on error
+ */
+CacheList *cache_create(size_t capacity, int nshards, int *fd)
+{
+    CacheList layout, *list;
+    size_t shard_size = cache_layout(capacity / nshards, &layout);
+    size_t size = shard_size * nshards;
+    void *base;
+
+    if (fd != NULL)
+    {
+        if ((*fd = memfd_create("proxy-cache", MFD_CLOEXEC)) < 0)
+            return NULL;
+        if (ftruncate(*fd, size) < 0 ||
+            (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0)) == MAP_FAILED)
+        {
+            close(*fd);
+            *fd = -1;
+            return NULL;
+        }
+    }
+    else if ((base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return NULL;
+
+    for (int i = 0; i < nshards; i++)
+    {
+        list = (CacheList *)((char *)base + shard_size * i);
+        *list = layout;
+        list->magic = CACHE_MAGIC;
+        list->version = CACHE_VERSION;
+        list->shared = fd != NULL;
+        list->nshards = nshards;
+        list->shard = i;
+        list->max_size = (size_t)layout.nblocks * CACHE_BLOCK_SIZE;
+        list->max_object_size = 0;
+        list->policy = CACHE_LRU;
+        cache_init(list);
+    }
+    return base;
+}
+
+/**
+ * @brief Map a cache created by another process (e.g. passed in a handoff)
+ *
+ * The region is only reused if it was laid out for the same capacity and
+ * shards by a binary with the same CACHE_VERSION; otherwise NULL is
+ * returned and the caller should create a fresh cache. The limits it was
+ * running with are kept until cache_configure() is called.
+ */
+CacheList *cache_attach(int fd, size_t capacity, int nshards)
+{
+    CacheList layout, *list;
+    size_t shard_size = cache_layout(capacity / nshards, &layout);
+    size_t size = shard_size * nshards;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != size)
+        return NULL;
+    list = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (list == MAP_FAILED)
+        return NULL;
+    if (list->magic != CACHE_MAGIC || list->version != CACHE_VERSION ||
+        list->nshards != nshards || list->region_size != shard_size ||
+        list->nblocks != layout.nblocks || list->blocks_off != layout.blocks_off)
+    {
+        munmap(list, size);
+        return NULL;
+    }
+    return list;
+}
+
+/**
+ * @brief The shard holding keys with this hash
+ *
+ * The low bits of the hash pick the bucket, so the high bits pick the shard.
+ */
+CacheList *cache_shard(CacheList *list, uint64_t hash)
+{
+    char *base = (char *)list - list->region_size * list->shard;
+    return (CacheList *)(base + list->region_size * ((hash >> 32) % list->nshards));
+}
+
+/**
+ * @brief Set the budget, the largest object admitted and the replacement
+ *        policy, as at startup or on a configuration reload
+ *
+ * The budget is split evenly across the shards and capped at the capacity
+ * the cache was created with. Lowering it evicts nothing here; inserts
+ * stop overshooting it and cache_trim() works the rest off.
+ */
+void cache_configure(CacheList *list, size_t max_size, size_t max_object_size, int policy)
+{
+    list = cache_shard(list, 0);
+    for (int i = 0; i < list->nshards; i++)
+    {
+        CacheList *shard = (CacheList *)((char *)list + list->region_size * i);
+        size_t capacity = (size_t)shard->nblocks * CACHE_BLOCK_SIZE;
+
+        cache_lock(shard);
+        shard->max_size = max_size / list->nshards < capacity ? max_size / list->nshards : capacity;
+        shard->max_object_size = max_object_size;
+        shard->policy = policy;
+        cache_unlock(shard);
+    }
+}
+
+/**
+ * @brief Evict up to batch objects from each shard that is over budget
+ *
+ * Each shard's lock is held for one batch only, so a large shrink is
+ * worked off in steps that other processes can interleave with.
+ *
+ * @return The number of shards still over budget
+ */
+int cache_trim(CacheList *list, int batch)
+{
+    int over = 0;
+
+    list = cache_shard(list, 0);
+    for (int i = 0; i < list->nshards; i++)
+    {
+        CacheList *shard = (CacheList *)((char *)list + list->region_size * i);
+
+        cache_lock(shard);
+        for (int n = 0; n < batch && shard->size > shard->max_size; n++)
+            evict(shard);
+        over += shard->size > shard->max_size;
+        cache_unlock(shard);
+    }
+    return over;
+}
+
+/**
+ * @brief Empty the cache: every entry and block back on its free list
+ *
+ * Caller holds the lock (or is the only user of the region).
+ */
+static void cache_reset(CacheList *list)
+{
+    int32_t *next = block_next(list);
+
+    for (int32_t i = 0; i < list->nbuckets; i++)
+        buckets(list)[i] = -1;
+    for (int32_t i = 0; i < list->nentries; i++)
+    {
+        entry(list, i)->in_use = 0;
+        entry(list, i)->hash_next = i + 1 < list->nentries ? i + 1 : -1;
+    }
+    for (int32_t b = 0; b < list->nblocks; b++)
+        next[b] = b + 1 < list->nblocks ? b + 1 : -1;
+    list->free_entry = 0;
+    list->free_block = 0;
+    list->free_blocks = list->nblocks;
+    list->head = -1;
+    list->tail = -1;
+    list->size = 0;
+    list->stored_bytes = 0;
+    list->raw_bytes = 0;
+    list->count = 0;
+}
+
+/**
+ * @brief Format a freshly mapped region and initialize its lock
+ */
+void cache_init(CacheList *list)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    if (list->shared)
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&list->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    list->hits = list->misses = list->insertions = list->evictions = 0;
+    cache_reset(list);
+}
+
+/**
+ * @brief Take the cache lock
+ *
+ * If the previous owner died holding it (a worker crashed mid-update),
+ * the index may be half-written; the cache is emptied rather than trusted.
+ */
+void cache_lock(CacheList *list)
+{
+    if (pthread_mutex_lock(&list->lock) == EOWNERDEAD)
+    {
+        fprintf(stderr, "cache: lock owner died, discarding cache contents\n");
+        cache_reset(list);
+        pthread_mutex_consistent(&list->lock);
+    }
+}
+
+void cache_unlock(CacheList *list)
+{
+    pthread_mutex_unlock(&list->lock);
+}
+
+/** @brief Pop n blocks off the free list and chain them together */
+static int32_t alloc_chain(CacheList *list, int32_t n)
+{
+    int32_t *next = block_next(list);
+    int32_t first = list->free_block, last = first;
+
+    for (int32_t i = 1; i < n; i++)
+        last = next[last];
+    list->free_block = next[last];
+    next[last] = -1;
+    list->free_blocks -= n;
+    return first;
+}
+
+static void free_chain(CacheList *list, int32_t first)
+{
+    int32_t *next = block_next(list);
+    int32_t last = first, n = 1;
+
+    while (next[last] != -1)
+    {
+        last = next[last];
+        n++;
+    }
+    next[last] = list->free_block;
+    list->free_block = first;
+    list->free_blocks += n;
+}
+
+/** @brief Copy len bytes into the chain starting at byte offset off */
+static void chain_write(CacheList *list, int32_t b, size_t off, const char *src, size_t len)
+{
+    int32_t *next = block_next(list);
+
+    for (; off >= CACHE_BLOCK_SIZE; off -= CACHE_BLOCK_SIZE)
+        b = next[b];
+    while (len > 0)
+    {
+        size_t n = CACHE_BLOCK_SIZE - off < len ? CACHE_BLOCK_SIZE - off : len;
+        memcpy(block(list, b) + off, src, n);
+        src += n;
+        len -= n;
+        off = 0;
+        b = next[b];
+    }
+}
+
+/** @brief Copy len bytes out of the chain starting at byte offset off */
+static void chain_read(CacheList *list, int32_t b, size_t off, char *dst, size_t len)
+{
+    int32_t *next = block_next(list);
+
+    for (; off >= CACHE_BLOCK_SIZE; off -= CACHE_BLOCK_SIZE)
+        b = next[b];
+    while (len > 0)
+    {
+        size_t n = CACHE_BLOCK_SIZE - off < len ? CACHE_BLOCK_SIZE - off : len;
+        memcpy(dst, block(list, b) + off, n);
+        dst += n;
+        len -= n;
+        off = 0;
+        b = next[b];
+    }
+}
+
+/** @brief Compare the first len bytes of the chain with key */
+static int chain_equal(CacheList *list, int32_t b, const char *key, size_t len)
+{
+    int32_t *next = block_next(list);
+
+    while (len > 0)
+    {
+        size_t n = CACHE_BLOCK_SIZE < len ? CACHE_BLOCK_SIZE : len;
+        if (memcmp(block(list, b), key, n) != 0)
+            return 0;
+        key += n;
+        len -= n;
+        b = next[b];
+    }
+    return 1;
+}
+
+static void lru_unlink(CacheList *list, int32_t i)
+{
+    CachedItem *item = entry(list, i);
+
+    if (item->prev == -1)
+        list->head = item->next;
+    else
+        entry(list, item->prev)->next = item->next;
+    if (item->next == -1)
+        list->tail = item->prev;
+    else
+        entry(list, item->next)->prev = item->prev;
+    item->prev = item->next = -1;
+}
+
+static void lru_push_front(CacheList *list, int32_t i)
+{
+    CachedItem *item = entry(list, i);
+
+    item->prev = -1;
+    item->next = list->head;
+    if (list->head != -1)
+        entry(list, list->head)->prev = i;
+    list->head = i;
+    if (list->tail == -1)
+        list->tail = i;
+}
+
+/** @brief Bytes an entry's object would take if it weren't compressed */
+static size_t raw_size(const CachedItem *item)
+{
+    if (item->meta.flags & CACHE_COMPRESSED)
+        return item->meta.header_len + item->meta.length;
+    return item->size;
+}
+
+/** @brief Unlink entry i from the index and LRU list and free its storage */
+static void remove_entry(CacheList *list, int32_t i)
+{
+    CachedItem *item = entry(list, i);
+    int32_t *link = &buckets(list)[item->hash & (list->nbuckets - 1)];
+
+    while (*link != i)
+        link = &entry(list, *link)->hash_next;
+    *link = item->hash_next;
+    lru_unlink(list, i);
+    free_chain(list, item->first_block);
+    list->size -= (size_t)item->nblocks * CACHE_BLOCK_SIZE;
+    list->stored_bytes -= item->size;
+    list->raw_bytes -= raw_size(item);
+    list->count--;
+    item->in_use = 0;
+    item->hash_next = list->free_entry;
+    list->free_entry = i;
+}
+
+/** @brief: add a new item to the cache, replacing any older copy
+ *  @param key: the key of the object, from key_from_url()
+ *  @param item: the value of the key
+ *  @param size: the size of the value
+ *  @param meta: the freshness record stored with it
+ *  @param list: the cache list
+ *  @return: 0 if cached, -1 if the object is too large to admit or
+ *           room can't be made for it yet
+ */
+int cache_URL(const CacheKey *key, void *item, size_t size, CacheMeta *meta, CacheList *list)
+{
+    size_t key_len = key->len;
+    int32_t need = blocks_for(key_len + size);
+    CachedItem *node;
+    int32_t i, evictions = 0;
+
+    list = cache_shard(list, key->hash);
+    if (size > list->max_object_size || need > list->nblocks)
+        return -1;
+
+    cache_lock(list);
+    if ((node = find(key, list)) != NULL)
+        remove_entry(list, entry_index(list, node));
+    while (list->size + (size_t)need * CACHE_BLOCK_SIZE > list->max_size ||
+           list->free_blocks < need || list->free_entry == -1)
+    {
+        /** far over a just-shrunk budget: leave it to cache_trim() */
+        if (evictions++ > need + CACHE_EVICT_SLACK || list->tail == -1)
+        {
+            cache_unlock(list);
+            return -1;
+        }
+        evict(list);
+    }
+
+    i = list->free_entry;
+    node = entry(list, i);
+    list->free_entry = node->hash_next;
+    node->hash = key->hash;
+    node->key_len = key_len;
+    node->size = size;
+    node->nblocks = need;
+    node->first_block = alloc_chain(list, need);
+    node->in_use = 1;
+    node->refresh_started = 0;
+    node->meta = *meta;
+    chain_write(list, node->first_block, 0, key->data, key_len);
+    chain_write(list, node->first_block, key_len, item, size);
+
+    node->hash_next = buckets(list)[node->hash & (list->nbuckets - 1)];
+    buckets(list)[node->hash & (list->nbuckets - 1)] = i;
+    lru_push_front(list, i);
+    list->size += (size_t)need * CACHE_BLOCK_SIZE;
+    list->stored_bytes += size;
+    list->raw_bytes += raw_size(node);
+    list->count++;
+    list->insertions++;
+    cache_unlock(list);
+    PROBE3(cache__insert, key->data, key_len, size);
+    return 0;
+}
+
+/**
+ * @brief Copy a cached object out of the cache
+ *
+ * The copy is taken under the lock, so the caller can write it to a slow
+ * client without holding up other processes or risking an eviction
+ * pulling the bytes out from under it.
+ *
+ * @param key The key to look up
+ * @param item Set to a malloc'ed copy of the object; caller frees it
+ * @param meta Set to the object's freshness record
+ * @return The size of the object, or -1 on a miss or if the copy
+ *         can't be allocated
+ */
+ssize_t cache_get(const CacheKey *key, void **item, CacheMeta *meta, CacheList *list)
+{
+    CachedItem *node;
+    ssize_t size;
+
+    list = cache_shard(list, key->hash);
+    cache_lock(list);
+    if ((node = find(key, list)) == NULL)
+    {
+        list->misses++;
+        cache_unlock(list);
+        PROBE2(cache__miss, key->data, key->len);
+        return -1;
+    }
+    /** move the last used cache to the front to maintain LRU alignment */
+    if (list->policy == CACHE_LRU)
+    {
+        lru_unlink(list, entry_index(list, node));
+        lru_push_front(list, entry_index(list, node));
+    }
+    size = node->size;
+    *meta = node->meta;
+    if ((*item = malloc(size > 0 ? size : 1)) == NULL)
+    {
+        /** no room for the copy: serve it from the origin instead */
+        list->misses++;
+        cache_unlock(list);
+        return -1;
+    }
+    chain_read(list, node->first_block, node->key_len, *item, size);
+    list->hits++;
+    cache_unlock(list);
+    PROBE3(cache__hit, key->data, key->len, size);
+    return size;
+}
+
+/**
+ * @brief Drop the object cached under key, if any
+ */
+void cache_remove(const CacheKey *key, CacheList *list)
+{
+    CachedItem *node;
+
+    list = cache_shard(list, key->hash);
+    cache_lock(list);
+    if ((node = find(key, list)) != NULL)
+        remove_entry(list, entry_index(list, node));
+    cache_unlock(list);
+}
+
+/**
+ * @brief Replace the freshness record of a cached object without touching
+ *        its bytes, as after a successful revalidation
+ *
+ * @param old The record the caller revalidated; if the entry has been
+ *        replaced since (its response_time differs) it is left alone
+ * @return 0 if the record was updated, -1 otherwise
+ */
+int cache_update_meta(const CacheKey *key, CacheMeta *old, CacheMeta *meta, CacheList *list)
+{
+    CachedItem *node;
+    int rc = -1;
+
+    list = cache_shard(list, key->hash);
+    cache_lock(list);
+    if ((node = find(key, list)) != NULL && node->meta.response_time == old->response_time)
+    {
+        list->raw_bytes -= raw_size(node);
+        node->meta = *meta;
+        list->raw_bytes += raw_size(node);
+        node->refresh_started = 0;
+        rc = 0;
+    }
+    cache_unlock(list);
+    return rc;
+}
+
+/**
+ * @brief Claim the right to refresh a stale object in the background
+ *
+ * Claims live in the shared region, so at most one process refreshes a
+ * given object at a time. A claim is released by replacing the object or
+ * its record, and expires after timeout seconds in case its owner died.
+ *
+ * @param old The record the caller found stale
+ * @return 1 if the caller now owns the refresh, 0 otherwise
+ */
+int cache_claim_refresh(const CacheKey *key, CacheMeta *old, int64_t now, int timeout, CacheList *list)
+{
+    CachedItem *node;
+    int rc = 0;
+
+    list = cache_shard(list, key->hash);
+    cache_lock(list);
+    if ((node = find(key, list)) != NULL && node->meta.response_time == old->response_time &&
+        (node->refresh_started == 0 || now - node->refresh_started > timeout))
+    {
+        node->refresh_started = now;
+        rc = 1;
+    }
+    cache_unlock(list);
+    return rc;
+}
+
+/**
+ * @brief Evict the last item in the cache
+ *
+ * @param list
+ */
+void evict(CacheList *list)
+{
+    if (list->tail == -1)
+        return;
+    PROBE2(cache__evict, entry(list, list->tail)->hash, entry(list, list->tail)->size);
+    remove_entry(list, list->tail);
+    list->evictions++;
+}
+
+/** @brief: find a key in the cache
+ *  @param key: the key to be searched, hash included
+ *  @param list: the cache list
+ *  @return: the entry of the key if found, NULL otherwise
+ */
+CachedItem *find(const CacheKey *key, CacheList *list)
+{
+    int32_t i = buckets(list)[key->hash & (list->nbuckets - 1)];
+
+    while (i != -1)
+    {
+        CachedItem *item = entry(list, i);
+        if (item->hash == key->hash && item->key_len == key->len &&
+            chain_equal(list, item->first_block, key->data, key->len))
+        {
+            return item;
+        }
+        i = item->hash_next;
+    }
+    return NULL;
+}
+
+void move_to_front(const CacheKey *key, CacheList *list)
+{
+    CachedItem *item = find(key, list);
+    if (item == NULL)
+        return;
+    lru_unlink(list, entry_index(list, item));
+    lru_push_front(list, entry_index(list, item));
+}
+
+/**
+ * @brief Print the keys of one shard, most recently used first
+ */
+static void print_shard(CacheList *list, char *url)
+{
+    cache_lock(list);
+    for (int32_t i = list->head; i != -1; i = entry(list, i)->next)
+    {
+        CachedItem *item = entry(list, i);
+        size_t n = item->key_len < CACHE_BLOCK_SIZE ? item->key_len : CACHE_BLOCK_SIZE;
+        chain_read(list, item->first_block, 0, url, n);
+        /** keys are binary (see key.c): escape what isn't printable */
+        for (size_t j = 0; j < n; j++)
+        {
+            unsigned char c = url[j];
+            if (c >= 0x20 && c < 0x7f)
+                putchar(c);
+            else
+                printf("\\x%02x", c);
+        }
+        putchar('\n');
+    }
+    cache_unlock(list);
+}
+
+/**
+ * @brief Sum the counters of every shard
+ *
+ * raw_bytes over stored_bytes is the capacity gained by compression.
+ */
+void cache_stats(CacheList *list, CacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    list = cache_shard(list, 0);
+    for (int i = 0; i < list->nshards; i++)
+    {
+        CacheList *shard = (CacheList *)((char *)list + list->region_size * i);
+
+        cache_lock(shard);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->insertions += shard->insertions;
+        stats->evictions += shard->evictions;
+        stats->count += shard->count;
+        stats->size += shard->size;
+        stats->max_size += shard->max_size;
+        stats->stored_bytes += shard->stored_bytes;
+        stats->raw_bytes += shard->raw_bytes;
+        cache_unlock(shard);
+    }
+}
+
+void print_URLs(CacheList *list)
+{
+    char url[CACHE_BLOCK_SIZE + 1];
+    CacheStats stats;
+
+    printf("-----------\n");
+    list = cache_shard(list, 0);
+    for (int s = 0; s < list->nshards; s++)
+    {
+        CacheList *shard = (CacheList *)((char *)list + list->region_size * s);
+        print_shard(shard, url);
+    }
+    cache_stats(list, &stats);
+    printf("%ld objects, %zu of %zu bytes", stats.count, stats.size, stats.max_size);
+    if (stats.raw_bytes > stats.stored_bytes)
+        printf(", %zu bytes of responses stored in %zu", stats.raw_bytes, stats.stored_bytes);
+    printf("\n-----------\n");
+}
+
+/**
+ * @brief Unmap the cache from this process
+ *
+ * A shared cache lives on as long as another process still maps it.
+ */
+void cache_destruct(CacheList *list)
+{
+    list = cache_shard(list, 0);
+    munmap(list, list->region_size * list->nshards);
+}
@@ -0,0 +1,189 @@
+/**
+ * @file cache.h
+ * @brief LRU web object cache living in one (optionally shared) memory region
+ *
+ * Everything inside the region is addressed by index, never by pointer, so
+ * the same cache can be mapped by several processes (prefork workers, or an
+ * old and a new proxy during a hot restart) at different addresses.
+ *
+ * The cache is split into shards, each with its own lock and LRU list;
+ * a key's hash picks its shard. Layout of the region:
+ *
+ *   shard 0 | shard 1 | ... | shard nshards - 1
+ *
+ * and of each shard:
+ *
+ *   CacheList | buckets[nbuckets] | entries[nentries] | block_next[nblocks] | blocks
+ *
+ * An object is stored as a chain of fixed-size blocks holding its key
+ * followed by its bytes, so no object ever needs contiguous memory and
+ * freeing never fragments. The hash index and the LRU list link entries
+ * by index, with -1 as the null link.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define CACHE_MAGIC 0x50524f58594341ULL /* "PROXYCA" */
+#define CACHE_VERSION 10
+#define CACHE_BLOCK_SIZE 1024
+
+/* CacheMeta flags, from the response's Cache-Control */
+#define CACHE_NO_STORE 0x01
+#define CACHE_NO_CACHE 0x02
+#define CACHE_PRIVATE 0x04
+#define CACHE_PUBLIC 0x08
+#define CACHE_MUST_REVALIDATE 0x10
+/* Not a response: the URL's Vary list, pointing at its variants */
+#define CACHE_VARIANTS 0x20
+/* Headers only; the body is in separately cached chunks */
+#define CACHE_CHUNKED 0x40
+/* The body is stored gzipped; the headers are the origin's */
+#define CACHE_COMPRESSED 0x80
+
+/* Replacement policies */
+#define CACHE_LRU 0  /* hits move an object to the front */
+#define CACHE_FIFO 1 /* objects are evicted in insertion order */
+
+/* Evictions cache_URL() may make beyond those an object needs; past a
+ * shrunk budget the rest is left to cache_trim() */
+#define CACHE_EVICT_SLACK 16
+
+/* Longest key: a URL (MAXLINE) in canonical form, see key.c */
+#define CACHE_KEY_MAX 8256
+
+/* Longest ETag kept for revalidation */
+#define CACHE_ETAG_MAX 96
+
+/**
+ * @brief Freshness record of a cached response, filled in by
+ *        http_parse_response() when the response is stored
+ */
+typedef struct
+{
+    int64_t request_time;  /* when the request was sent upstream */
+    int64_t response_time; /* when the response arrived */
+    int64_t date;          /* Date header, or response_time */
+    int64_t expires;       /* Expires header, or 0 */
+    int64_t last_modified; /* Last-Modified header, or 0 */
+    int32_t age;           /* Age header, or 0 */
+    int32_t max_age;       /* Cache-Control max-age, or -1 */
+    int32_t s_maxage;      /* Cache-Control s-maxage, or -1 */
+    int32_t stale_while_revalidate; /* seconds, or -1 (RFC 5861) */
+    int32_t stale_if_error;         /* seconds, or -1 */
+    int32_t initial_age;   /* corrected initial age (RFC 9111 4.2.3) */
+    int32_t lifetime;      /* freshness lifetime (RFC 9111 4.2.1) */
+    uint16_t status;
+    uint16_t flags;
+    uint32_t header_len;   /* status line and headers, blank line included */
+    uint32_t age_slot;     /* offset of the Age value slot in the headers, or 0 */
+    uint64_t variant;      /* hash of the request headers named by Vary */
+    uint64_t object_id;    /* CACHE_CHUNKED: shared by the object's chunks */
+    int64_t length;        /* CACHE_CHUNKED, CACHE_COMPRESSED: body length */
+    char etag[CACHE_ETAG_MAX]; /* ETag header, or "" */
+} CacheMeta;
+
+/**
+ * @brief A key and its hash, computed once by cache_key_hash() rather
+ *        than on every lookup
+ */
+typedef struct
+{
+    uint64_t hash;
+    uint32_t len;
+    char data[CACHE_KEY_MAX]; /* binary; not NUL-terminated */
+} CacheKey;
+
+typedef struct
+{
+    uint64_t hash;        /* hash of the key */
+    uint32_t key_len;     /* bytes of key at the start of the chain */
+    uint32_t size;        /* bytes of object following the key */
+    int32_t first_block;  /* head of the block chain */
+    int32_t nblocks;      /* blocks in the chain */
+    int32_t prev;         /* LRU neighbour towards the head */
+    int32_t next;         /* LRU neighbour towards the tail */
+    int32_t hash_next;    /* next entry in the same bucket, or the free list */
+    int32_t in_use;
+    int64_t refresh_started; /* background refresh claimed at, or 0 */
+    CacheMeta meta;
+} CachedItem;
+
+/**
+ * @brief Ordered by most recent
+ *
+ */
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t shared;        /* mapped MAP_SHARED with a process-shared lock */
+    int32_t nshards;
+    int32_t shard;          /* index of this shard */
+    size_t region_size;     /* bytes of one shard */
+    size_t buckets_off;     /* offsets of the arrays from the region start */
+    size_t entries_off;
+    size_t block_next_off;
+    size_t blocks_off;
+    int32_t nbuckets;
+    int32_t nentries;
+    int32_t nblocks;
+    int32_t head;           /* most recently used */
+    int32_t tail;           /* least recently used, evicted first */
+    int32_t free_entry;     /* free list of entries, through hash_next */
+    int32_t free_block;     /* free list of blocks, through block_next */
+    int32_t free_blocks;
+    size_t size;            /* bytes of blocks in use */
+    size_t max_size;        /* budget; size only exceeds it right after a shrink */
+    size_t max_object_size; /* largest object admitted */
+    int32_t policy;         /* CACHE_LRU or CACHE_FIFO */
+    int count;              /* objects cached */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    size_t stored_bytes;    /* bytes of objects, as stored */
+    size_t raw_bytes;       /* what they would take with nothing compressed */
+    pthread_mutex_t lock;   /* robust, so a crashed worker can't wedge it */
+} CacheList;
+
+/* Counters summed over the shards, from cache_stats() */
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    long count;
+    size_t size;         /* bytes of blocks in use */
+    size_t max_size;     /* the budget */
+    size_t stored_bytes; /* bytes of objects, as stored */
+    size_t raw_bytes;    /* the same objects uncompressed */
+} CacheStats;
+
+CacheList *cache_create(size_t capacity, int nshards, int *fd);
+CacheList *cache_attach(int fd, size_t capacity, int nshards);
+void cache_configure(CacheList *list, size_t max_size, size_t max_object_size, int policy);
+int cache_trim(CacheList *list, int batch);
+CacheList *cache_shard(CacheList *list, uint64_t hash);
+void cache_init(CacheList *list);
+void cache_lock(CacheList *list);
+void cache_unlock(CacheList *list);
+void cache_key_hash(CacheKey *key);
+int cache_URL(const CacheKey *key, void *item, size_t size, CacheMeta *meta, CacheList *list);
+ssize_t cache_get(const CacheKey *key, void **item, CacheMeta *meta, CacheList *list);
+void cache_remove(const CacheKey *key, CacheList *list);
+int cache_update_meta(const CacheKey *key, CacheMeta *old, CacheMeta *meta, CacheList *list);
+int cache_claim_refresh(const CacheKey *key, CacheMeta *old, int64_t now, int timeout, CacheList *list);
+void evict(CacheList *list);
+CachedItem *find(const CacheKey *key, CacheList *list);
+void move_to_front(const CacheKey *key, CacheList *list);
+void cache_stats(CacheList *list, CacheStats *stats);
+void print_URLs(CacheList *list);
+void cache_destruct(CacheList *list);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,231 @@
+/**
+ * @file config.c
+ * @brief Runtime configuration: a config file (-c) and command-line
+ *        overrides, re-read on SIGHUP
+ *
+ * The file holds one "name = value" setting per line; '#' starts a
+ * comment. Sizes take an optional K, M or G suffix. The names are those
+ * of the Config fields:
+ *
+ *   cache_size = 64M
+ *   cache_limit = 1G
+ *   max_object_size = 512K
+ *   shards = 8
+ *   workers = 4
+ *   policy = lru
+ *   max_headers = 100
+ *   compress = 1
+ *   log_level = info
+ *   trace_file = /tmp/proxy-trace.json
+ *   trace_sample = 100
+ *   connect_timeout = 10
+ *   first_byte_timeout = 30
+ *   idle_timeout = 30
+ *   total_timeout = 300
+ *   client_timeout = 60
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "config.h"
+#include "cache.h"
+#include "log.h"
+
+void config_defaults(Config *cfg)
+{
+    cfg->cache_size = CONFIG_CACHE_SIZE;
+    cfg->cache_limit = 0; /* the cache_size, unless set */
+    cfg->max_object_size = CONFIG_MAX_OBJECT_SIZE;
+    cfg->shards = 1;
+    cfg->workers = 0;
+    cfg->policy = CACHE_LRU;
+    cfg->max_headers = CONFIG_MAX_HEADERS;
+    cfg->compress = 0;
+    cfg->log_level = LOG_LEVEL_INFO;
+    cfg->trace_file[0] = '\0';
+    cfg->trace_sample = 0;
+    cfg->connect_timeout = CONFIG_CONNECT_TIMEOUT;
+    cfg->first_byte_timeout = CONFIG_FIRST_BYTE_TIMEOUT;
+    cfg->idle_timeout = CONFIG_IDLE_TIMEOUT;
+    cfg->total_timeout = CONFIG_TOTAL_TIMEOUT;
+    cfg->client_timeout = CONFIG_CLIENT_TIMEOUT;
+}
+
+static int parse_size(const char *value, size_t *size)
+{
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+
+    if (end == value)
+        return -1;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        n <<= 10;
+        /* fall through */
+    case 'M':
+        n <<= 10;
+        /* fall through */
+    case 'K':
+        n <<= 10;
+        end++;
+    }
+    if (*end != '\0')
+        return -1;
+    *size = n;
+    return 0;
+}
+
+static int parse_int(const char *value, int *n)
+{
+    char *end;
+    long v = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || v < 0 || v > 1 << 20)
+        return -1;
+    *n = v;
+    return 0;
+}
+
+/**
+ * @brief Set one setting by name, as from the config file or the command line
+ *
+ * @return 0 on success, -1 for an unknown name or a bad value
+ */
+int config_set(Config *cfg, const char *name, const char *value)
+{
+    if (strcmp(name, "cache_size") == 0)
+        return parse_size(value, &cfg->cache_size);
+    if (strcmp(name, "cache_limit") == 0)
+        return parse_size(value, &cfg->cache_limit);
+    if (strcmp(name, "max_object_size") == 0)
+        return parse_size(value, &cfg->max_object_size);
+    if (strcmp(name, "shards") == 0)
+        return parse_int(value, &cfg->shards);
+    if (strcmp(name, "workers") == 0)
+        return parse_int(value, &cfg->workers);
+    if (strcmp(name, "max_headers") == 0)
+        return parse_int(value, &cfg->max_headers);
+    if (strcmp(name, "compress") == 0)
+        return parse_int(value, &cfg->compress);
+    if (strcmp(name, "connect_timeout") == 0)
+        return parse_int(value, &cfg->connect_timeout);
+    if (strcmp(name, "first_byte_timeout") == 0)
+        return parse_int(value, &cfg->first_byte_timeout);
+    if (strcmp(name, "idle_timeout") == 0)
+        return parse_int(value, &cfg->idle_timeout);
+    if (strcmp(name, "total_timeout") == 0)
+        return parse_int(value, &cfg->total_timeout);
+    if (strcmp(name, "client_timeout") == 0)
+        return parse_int(value, &cfg->client_timeout);
+    if (strcmp(name, "trace_sample") == 0)
+        return parse_int(value, &cfg->trace_sample);
+    if (strcmp(name, "trace_file") == 0)
+    {
+        if (strlen(value) >= sizeof(cfg->trace_file))
+            return -1;
+        strcpy(cfg->trace_file, value);
+        return 0;
+    }
+    if (strcmp(name, "log_level") == 0)
+        return (cfg->log_level = log_parse_level(value)) < 0 ? -1 : 0;
+    if (strcmp(name, "policy") == 0)
+    {
+        if (strcasecmp(value, "lru") == 0)
+            cfg->policy = CACHE_LRU;
+        else if (strcasecmp(value, "fifo") == 0)
+            cfg->policy = CACHE_FIFO;
+        else
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Apply the settings in the file at path on top of cfg
+ *
+ * @return 0 on success, -1 if the file can't be read or has a bad line
+ *         (reported on stderr)
+ */
+int config_load(const char *path, Config *cfg)
+{
+    char line[1024], *name, *value, *end;
+    FILE *fp;
+    int lineno = 0, rc = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        name = line + strspn(line, " \t");
+        if (*name == '\0')
+            continue;
+        if ((value = strchr(name, '=')) == NULL)
+        {
+            fprintf(stderr, "%s:%d: expected name = value\n", path, lineno);
+            rc = -1;
+            continue;
+        }
+        for (end = value; end > name && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = '\0';
+        value += 1 + strspn(value + 1, " \t");
+        for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = '\0';
+        if (config_set(cfg, name, value) < 0)
+        {
+            fprintf(stderr, "%s:%d: bad setting %s = %s\n", path, lineno, name, value);
+            rc = -1;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/**
+ * @brief Check the settings fit together, filling in the cache_limit
+ *
+ * @return 0 if they do, -1 (reported on stderr) otherwise
+ */
+int config_check(Config *cfg)
+{
+    if (cfg->cache_limit == 0)
+        cfg->cache_limit = cfg->cache_size;
+    if (cfg->cache_size == 0 || cfg->cache_size > cfg->cache_limit)
+    {
+        fprintf(stderr, "config: cache_size must be between 1 and cache_limit (%zu)\n",
+                cfg->cache_limit);
+        return -1;
+    }
+    if (cfg->max_object_size == 0)
+    {
+        fprintf(stderr, "config: max_object_size must be positive\n");
+        return -1;
+    }
+    if (cfg->shards < 1 || cfg->shards > CONFIG_MAX_SHARDS)
+    {
+        fprintf(stderr, "config: shards must be between 1 and %d\n", CONFIG_MAX_SHARDS);
+        return -1;
+    }
+    if (cfg->workers > CONFIG_MAX_WORKERS)
+    {
+        fprintf(stderr, "config: at most %d workers\n", CONFIG_MAX_WORKERS);
+        return -1;
+    }
+    if (cfg->max_headers < CONFIG_MIN_HEADERS)
+    {
+        fprintf(stderr, "config: max_headers must be at least %d\n", CONFIG_MIN_HEADERS);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file config.h
+ * @brief Runtime configuration: a config file (-c) and command-line
+ *        overrides, re-read on SIGHUP
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stddef.h>
+
+/* Defaults, as the proxy had them at compile time */
+#define CONFIG_CACHE_SIZE 1049000
+#define CONFIG_MAX_OBJECT_SIZE 102400
+#define CONFIG_MAX_HEADERS 100
+#define CONFIG_CONNECT_TIMEOUT 10
+#define CONFIG_FIRST_BYTE_TIMEOUT 30
+#define CONFIG_IDLE_TIMEOUT 30
+#define CONFIG_TOTAL_TIMEOUT 300
+#define CONFIG_CLIENT_TIMEOUT 60
+
+/* Room for a path setting */
+#define CONFIG_PATH_MAX 256
+
+/* Bounds checked by config_check() */
+#define CONFIG_MAX_SHARDS 64
+#define CONFIG_MAX_WORKERS 64
+#define CONFIG_MIN_HEADERS 16
+
+typedef struct
+{
+    size_t cache_size;      /* cache budget; can change on reload */
+    size_t cache_limit;     /* largest budget a reload may set; sizes the mapping */
+    size_t max_object_size; /* largest object cached whole */
+    int shards;             /* independently locked cache partitions */
+    int workers;            /* prefork workers, 0 for a single process */
+    int policy;             /* CACHE_LRU or CACHE_FIFO */
+    int max_headers;        /* request headers kept per request */
+    int compress;           /* store compressible bodies gzipped */
+    int log_level;          /* LOG_LEVEL_*, by name in the file */
+    char trace_file[CONFIG_PATH_MAX]; /* where sampled requests are traced, "" for nowhere */
+    int trace_sample;       /* trace about one request in this many, 0 for none */
+    /* Deadlines in seconds, 0 for none */
+    int connect_timeout;    /* connecting to the origin */
+    int first_byte_timeout; /* from sending the request to the response's first line */
+    int idle_timeout;       /* between reads of the rest of the response */
+    int total_timeout;      /* for the whole response */
+    int client_timeout;     /* each read from and write to the client */
+} Config;
+
+void config_defaults(Config *cfg);
+int config_set(Config *cfg, const char *name, const char *value);
+int config_load(const char *path, Config *cfg);
+int config_check(Config *cfg);
+
+#endif /* __CONFIG_H__ */
@@ -794,6 +794,38 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write every byte of an iovec (unbuffered)
+ *    The iovec is consumed: entries already written are advanced past.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0)
+    {
+        if ((nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt)) < 0)
+        {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                continue;       /* and call writev() again */
+            return -1;          /* errno set by writev() */
+        }
+        total += nwritten;
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len)
+        {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -921,6 +953,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
         unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+        unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
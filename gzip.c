@@ -0,0 +1,70 @@
+/**
+ * @file gzip.c
+ * @brief The gzip content coding (RFC 9110 8.4.1.3), with zlib
+ */
+
+#include <stdlib.h>
+#include <zlib.h>
+#include "gzip.h"
+
+/* windowBits for deflateInit2(): a 32K window with a gzip wrapper */
+#define GZIP_WINDOW (15 + 16)
+
+/**
+ * @brief Compress len bytes of src into a gzip member
+ *
+ * @param out Set to a malloc'ed buffer with the result, freed by the caller
+ * @return The compressed length, or -1 if compression failed or wouldn't
+ *         make the data smaller
+ */
+ssize_t gzip_compress(const char *src, size_t len, int level, char **out)
+{
+    z_stream z = {0};
+    size_t bound;
+    int rc;
+
+    if (deflateInit2(&z, level, Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    /** a result no smaller than the input is no use: don't make room for it */
+    bound = deflateBound(&z, len);
+    bound = bound < len ? bound : len;
+    if ((*out = malloc(bound)) == NULL)
+    {
+        deflateEnd(&z);
+        return -1;
+    }
+    z.next_in = (Bytef *)src;
+    z.avail_in = len;
+    z.next_out = (Bytef *)*out;
+    z.avail_out = bound;
+    rc = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END)
+    {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    return z.total_out;
+}
+
+/**
+ * @brief Inflate a gzip member into out, which holds outlen bytes
+ *
+ * @return The inflated length, or -1 if src is corrupt or doesn't fit
+ */
+ssize_t gzip_decompress(const char *src, size_t len, char *out, size_t outlen)
+{
+    z_stream z = {0};
+    int rc;
+
+    if (inflateInit2(&z, GZIP_WINDOW) != Z_OK)
+        return -1;
+    z.next_in = (Bytef *)src;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = outlen;
+    rc = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    return rc == Z_STREAM_END ? (ssize_t)z.total_out : -1;
+}
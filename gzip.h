@@ -0,0 +1,24 @@
+/**
+ * @file gzip.h
+ * @brief The gzip content coding (RFC 9110 8.4.1.3), with zlib
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <sys/types.h>
+
+/* zlib level for responses compressed on the way to the client; the
+ * result is cached, so this is paid once per response */
+#define GZIP_LEVEL 6
+
+/* zlib level for bodies compressed only to take less cache (-z), where
+ * speed matters more than the last few percent */
+#define GZIP_FAST_LEVEL 1
+
+/* Bodies smaller than this aren't worth compressing */
+#define GZIP_MIN_SIZE 256
+
+ssize_t gzip_compress(const char *src, size_t len, int level, char **out);
+ssize_t gzip_decompress(const char *src, size_t len, char *out, size_t outlen);
+
+#endif /* __GZIP_H__ */
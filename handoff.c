@@ -0,0 +1,210 @@
+/**
+ * @file handoff.c
+ * @brief Listening-socket handoff between an old and a new proxy process
+ *
+ * All functions return -1 on failure instead of exiting: a failed upgrade
+ * must leave the old process serving as if nothing happened.
+ */
+
+#include <sys/un.h>
+#include "csapp.h"
+#include "handoff.h"
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Where this process binds its handoff socket until handoff_publish() */
+static int handoff_tmp_path(const char *path, char *tmp, size_t len)
+{
+    if ((size_t)snprintf(tmp, len, "%s.%d", path, (int)getpid()) >= len)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Bind a fresh handoff socket next to path
+ *
+ * The socket at path, if any, still belongs to the old proxy: it is only
+ * replaced by handoff_publish(), once the upgrade can no longer fail.
+ *
+ * @param path Filesystem path of the Unix domain socket
+ * @return The listening descriptor, or -1 on error
+ */
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    char tmp[sizeof(addr.sun_path)];
+    int fd;
+
+    if (handoff_tmp_path(path, tmp, sizeof(tmp)) < 0 || handoff_addr(tmp, &addr) < 0)
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    unlink(tmp); /* left by an earlier process with our pid */
+    if (bind(fd, (SA *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * @brief Move the socket bound by handoff_listen() over path, so that the
+ *        next upgrade finds this process
+ *
+ * @return 0 on success, -1 on error (the temporary socket is removed)
+ */
+int handoff_publish(const char *path)
+{
+    char tmp[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    if (handoff_tmp_path(path, tmp, sizeof(tmp)) < 0)
+        return -1;
+    if (rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Connect to a running proxy's handoff socket
+ *
+ * @param path Filesystem path of the Unix domain socket
+ * @return The connected descriptor, or -1 if nobody is listening
+ */
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (handoff_addr(path, &addr) < 0)
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Send nfds descriptors as SCM_RIGHTS along with a one-byte payload
+ *
+ * @return 0 on success, -1 on error
+ */
+int handoff_send_fds(int sockfd, int *fds, int nfds)
+{
+    char payload = (char)nfds;
+    struct iovec iov = {&payload, 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (nfds <= 0 || nfds > HANDOFF_MAX_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    while (sendmsg(sockfd, &msg, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive up to maxfds descriptors sent by handoff_send_fds
+ *
+ * @return The number of descriptors stored in fds, or -1 on error
+ */
+int handoff_recv_fds(int sockfd, int *fds, int maxfds)
+{
+    char payload;
+    struct iovec iov = {&payload, 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int nfds;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    while ((n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != 1 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nfds != payload || nfds > maxfds)
+    {
+        /* Don't leak what we were given */
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < nfds; i++)
+            close(received[i]);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    return nfds;
+}
+
+int handoff_send_byte(int sockfd, char c)
+{
+    return rio_writen(sockfd, &c, 1) == 1 ? 0 : -1;
+}
+
+int handoff_recv_byte(int sockfd, char *c)
+{
+    return rio_readn(sockfd, c, 1) == 1 ? 0 : -1;
+}
@@ -0,0 +1,32 @@
+/**
+ * @file handoff.h
+ * @brief Listening-socket handoff between an old and a new proxy process
+ *
+ * The running proxy listens on a Unix domain socket. A freshly started
+ * proxy connects to it, receives the already-bound listening descriptor
+ * (plus any other shared descriptors) as SCM_RIGHTS ancillary data, and
+ * acknowledges once it is ready to accept. The kernel listen queue stays
+ * open the whole time, so no connection is refused during the upgrade.
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+/* Upper bound on descriptors passed in one handoff */
+#define HANDOFF_MAX_FDS 4
+
+/* Protocol bytes exchanged over the handoff socket */
+#define HANDOFF_REQUEST 'U' /* new -> old: please hand over */
+#define HANDOFF_READY 'R'   /* new -> old: accepting now, start draining */
+
+/* Seconds the old process waits for HANDOFF_READY before giving up */
+#define HANDOFF_TIMEOUT 5
+
+int handoff_listen(const char *path);
+int handoff_publish(const char *path);
+int handoff_connect(const char *path);
+int handoff_send_fds(int sockfd, int *fds, int nfds);
+int handoff_recv_fds(int sockfd, int *fds, int maxfds);
+int handoff_send_byte(int sockfd, char c);
+int handoff_recv_byte(int sockfd, char *c);
+
+#endif /* __HANDOFF_H__ */
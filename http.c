@@ -0,0 +1,1022 @@
+/**
+ * @file http.c
+ * @brief HTTP header parsing for the cache: freshness, cacheability and
+ *        conditional requests
+ *
+ * Response headers are parsed once, when a response is about to be stored,
+ * into the compact CacheMeta record kept with each cached object. Serving
+ * a hit then only needs http_current_age() and http_is_fresh().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http.h"
+
+/**
+ * @brief Step through the header lines of a response or request
+ *
+ * The first line (request or status line) is not a header; pass a pointer
+ * just past it. Stops at the blank line that ends the headers.
+ *
+ * @param p Start of the next header line
+ * @param end End of the header block
+ * @param name Set to the header name (not NUL-terminated)
+ * @param value Set to the value with surrounding whitespace trimmed
+ * @return Start of the line after this one, or NULL when there are no
+ *         more headers
+ */
+const char *http_next_header(const char *p, const char *end,
+                             const char **name, size_t *name_len,
+                             const char **value, size_t *value_len)
+{
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *line_end, *colon;
+
+        if (eol == NULL)
+            eol = end;
+        line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line_end == p)
+            return NULL; /* blank line: end of headers */
+        colon = memchr(p, ':', line_end - p);
+        if (colon != NULL)
+        {
+            const char *v = colon + 1, *vend = line_end;
+            while (v < vend && (*v == ' ' || *v == '\t'))
+                v++;
+            while (vend > v && (vend[-1] == ' ' || vend[-1] == '\t'))
+                vend--;
+            *name = p;
+            *name_len = colon - p;
+            *value = v;
+            *value_len = vend - v;
+            return eol < end ? eol + 1 : end;
+        }
+        p = eol + 1; /* not a header line; skip it */
+    }
+    return NULL;
+}
+
+/** @brief Case-insensitive comparison of a header name with expected */
+int http_header_is(const char *name, size_t name_len, const char *expected)
+{
+    return strlen(expected) == name_len && strncasecmp(name, expected, name_len) == 0;
+}
+
+/**
+ * @brief Parse an HTTP-date (IMF-fixdate, or the obsolete RFC 850 and
+ *        asctime formats)
+ *
+ * @return The time, or -1 if the date is malformed
+ */
+time_t http_parse_date(const char *s, size_t len)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT", /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S GMT", /* RFC 850 */
+        "%a %b %e %H:%M:%S %Y",      /* asctime */
+    };
+    char buf[64];
+    struct tm tm;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        char *rest;
+        memset(&tm, 0, sizeof(tm));
+        if ((rest = strptime(buf, formats[i], &tm)) != NULL && *rest == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/** @brief Parse "delta-seconds"; -1 if malformed */
+static long parse_seconds(const char *s, size_t len)
+{
+    long v = 0;
+
+    if (len == 0)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isdigit((unsigned char)s[i]))
+            return -1;
+        if (v < 0x7fffffff / 10)
+            v = v * 10 + (s[i] - '0');
+    }
+    return v;
+}
+
+/**
+ * @brief Parse the directives of one Cache-Control header into meta
+ */
+static void parse_cache_control(const char *v, size_t len, CacheMeta *meta)
+{
+    const char *end = v + len;
+
+    while (v < end)
+    {
+        const char *d = v, *dend, *arg = NULL;
+        size_t dlen, arglen = 0;
+
+        while (v < end && *v != ',')
+            v++;
+        dend = v++;
+        while (d < dend && isspace((unsigned char)*d))
+            d++;
+        while (dend > d && isspace((unsigned char)dend[-1]))
+            dend--;
+        for (const char *eq = d; eq < dend; eq++)
+        {
+            if (*eq == '=')
+            {
+                arg = eq + 1;
+                arglen = dend - arg;
+                dend = eq;
+                if (arglen >= 2 && arg[0] == '"' && arg[arglen - 1] == '"')
+                {
+                    arg++;
+                    arglen -= 2;
+                }
+                break;
+            }
+        }
+        dlen = dend - d;
+
+        if (http_header_is(d, dlen, "no-store"))
+            meta->flags |= CACHE_NO_STORE;
+        else if (http_header_is(d, dlen, "no-cache"))
+            meta->flags |= CACHE_NO_CACHE;
+        else if (http_header_is(d, dlen, "private"))
+            meta->flags |= CACHE_PRIVATE;
+        else if (http_header_is(d, dlen, "public"))
+            meta->flags |= CACHE_PUBLIC;
+        else if (http_header_is(d, dlen, "must-revalidate") ||
+                 http_header_is(d, dlen, "proxy-revalidate"))
+            meta->flags |= CACHE_MUST_REVALIDATE;
+        else if (http_header_is(d, dlen, "max-age") && arg != NULL)
+            meta->max_age = parse_seconds(arg, arglen);
+        else if (http_header_is(d, dlen, "s-maxage") && arg != NULL)
+            meta->s_maxage = parse_seconds(arg, arglen);
+        else if (http_header_is(d, dlen, "stale-while-revalidate") && arg != NULL)
+            meta->stale_while_revalidate = parse_seconds(arg, arglen);
+        else if (http_header_is(d, dlen, "stale-if-error") && arg != NULL)
+            meta->stale_if_error = parse_seconds(arg, arglen);
+    }
+}
+
+/** @brief Status codes a cache may store without explicit freshness */
+static int heuristically_cacheable(int status)
+{
+    switch (status)
+    {
+    case 200:
+    case 203:
+    case 300:
+    case 301:
+    case 308:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/** @brief Status codes a cache may store at all, given explicit freshness */
+static int cacheable_status(int status)
+{
+    switch (status)
+    {
+    case 204:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        return 1;
+    default:
+        return heuristically_cacheable(status);
+    }
+}
+
+/**
+ * @brief Record the cache-related headers of a header block in meta
+ *
+ * Only fields present in the headers are touched.
+ *
+ * @param p Start of the first header line (just past the status line)
+ * @return 1 if the headers carried any explicit freshness information
+ */
+static int parse_cache_headers(const char *p, const char *end, CacheMeta *meta)
+{
+    const char *name, *value;
+    size_t name_len, value_len;
+    int explicit = 0;
+
+    while ((p = http_next_header(p, end, &name, &name_len, &value, &value_len)) != NULL)
+    {
+        if (http_header_is(name, name_len, "Cache-Control"))
+        {
+            parse_cache_control(value, value_len, meta);
+            explicit = 1;
+        }
+        else if (http_header_is(name, name_len, "Pragma") &&
+                 value_len >= 8 && strncasecmp(value, "no-cache", 8) == 0)
+            meta->flags |= CACHE_NO_CACHE;
+        else if (http_header_is(name, name_len, "Date"))
+        {
+            time_t t = http_parse_date(value, value_len);
+            if (t != -1)
+                meta->date = t;
+        }
+        else if (http_header_is(name, name_len, "Expires"))
+        {
+            /* an invalid Expires means "already expired" */
+            time_t t = http_parse_date(value, value_len);
+            meta->expires = t == -1 ? 1 : t;
+            explicit = 1;
+        }
+        else if (http_header_is(name, name_len, "Last-Modified"))
+        {
+            time_t t = http_parse_date(value, value_len);
+            if (t != -1)
+                meta->last_modified = t;
+        }
+        else if (http_header_is(name, name_len, "ETag"))
+        {
+            /* too long to keep: behave as if there were no ETag */
+            if (value_len < sizeof(meta->etag))
+            {
+                memcpy(meta->etag, value, value_len);
+                meta->etag[value_len] = '\0';
+            }
+        }
+        else if (http_header_is(name, name_len, "Age"))
+        {
+            long age = parse_seconds(value, value_len);
+            if (age > 0)
+                meta->age = age;
+        }
+    }
+    return explicit;
+}
+
+/**
+ * @brief Fill in initial_age and lifetime from the parsed fields
+ *
+ * @return 0 if the response has no explicit lifetime and its status
+ *         doesn't allow a heuristic one
+ */
+static int compute_freshness(CacheMeta *meta)
+{
+    long apparent_age, corrected_age;
+
+    /* RFC 9111 4.2.3: age the response already had when it arrived */
+    apparent_age = meta->response_time - meta->date;
+    if (apparent_age < 0)
+        apparent_age = 0;
+    corrected_age = meta->age + (meta->response_time - meta->request_time);
+    meta->initial_age = apparent_age > corrected_age ? apparent_age : corrected_age;
+
+    /* RFC 9111 4.2.1: a shared cache prefers s-maxage */
+    if (meta->s_maxage >= 0)
+        meta->lifetime = meta->s_maxage;
+    else if (meta->max_age >= 0)
+        meta->lifetime = meta->max_age;
+    else if (meta->expires != 0)
+        meta->lifetime = meta->expires - meta->date;
+    else if (heuristically_cacheable(meta->status) || (meta->flags & CACHE_PUBLIC))
+    {
+        if (meta->last_modified > 0 && meta->last_modified < meta->date)
+        {
+            meta->lifetime = (meta->date - meta->last_modified) / HEURISTIC_FRACTION;
+            if (meta->lifetime > HEURISTIC_MAX)
+                meta->lifetime = HEURISTIC_MAX;
+        }
+        else
+            meta->lifetime = HEURISTIC_DEFAULT;
+    }
+    else
+        return 0;
+    return 1;
+}
+
+static void init_meta(CacheMeta *meta, time_t request_time, time_t response_time)
+{
+    memset(meta, 0, sizeof(*meta));
+    meta->request_time = request_time;
+    meta->response_time = response_time;
+    meta->date = response_time;
+    meta->max_age = -1;
+    meta->s_maxage = -1;
+    meta->stale_while_revalidate = -1;
+    meta->stale_if_error = -1;
+}
+
+/**
+ * @brief Parse the status code of a status line
+ *
+ * @return The status code, or -1 if this is not an HTTP response
+ */
+int http_status(const char *headers, size_t len)
+{
+    const char *sp;
+
+    /* "HTTP/1.x NNN reason" */
+    if (len < 12 || strncmp(headers, "HTTP/", 5) != 0)
+        return -1;
+    if ((sp = memchr(headers, ' ', len)) == NULL || headers + len - sp < 4)
+        return -1;
+    return atoi(sp + 1);
+}
+
+/**
+ * @brief Parse the status line and headers of a response into meta
+ *
+ * @param headers The status line and headers, up to and including the
+ *        blank line
+ * @param request_time When the request was sent upstream
+ * @param response_time When the response headers arrived
+ * @return 1 if the response may be stored by a shared cache and is
+ *         usable once stored, 0 otherwise
+ */
+int http_parse_response(const char *headers, size_t len, time_t request_time,
+                        time_t response_time, CacheMeta *meta)
+{
+    const char *p;
+    char vary[VARY_MAX];
+    int status;
+
+    init_meta(meta, request_time, response_time);
+    meta->header_len = len;
+    /* status is a uint16_t: check the code before it is narrowed */
+    if ((status = http_status(headers, len)) < 100 || status > 599)
+        return 0;
+    meta->status = status;
+    if ((p = memchr(headers, '\n', len)) == NULL)
+        return 0;
+    parse_cache_headers(p + 1, headers + len, meta);
+
+    if (!compute_freshness(meta))
+        return 0; /* no explicit lifetime and not heuristically cacheable */
+    if (meta->flags & (CACHE_NO_STORE | CACHE_PRIVATE))
+        return 0;
+    if (!cacheable_status(meta->status))
+        return 0;
+    /* Vary: * (or a list too long to key on) matches no later request */
+    if (http_vary(headers, len, vary, sizeof(vary)) < 0)
+        return 0;
+    /* no-cache: every use needs a revalidation, so only worth storing if
+     * there is something to revalidate with */
+    if (meta->flags & CACHE_NO_CACHE)
+        return meta->etag[0] != '\0' || meta->last_modified != 0;
+    /* stale on arrival and can't be revalidated: would only waste space */
+    return meta->lifetime > meta->initial_age || meta->etag[0] != '\0' || meta->last_modified != 0;
+}
+
+/**
+ * @brief Freshen a stored response's record with a 304 (RFC 9111 4.3.4)
+ *
+ * Headers in the 304 replace the stored ones; freshness directives the
+ * 304 doesn't repeat are kept from the stored response.
+ *
+ * @param headers The 304's status line and headers
+ * @param stored The record of the response being revalidated
+ * @param meta Set to the freshened record
+ */
+void http_parse_not_modified(const char *headers, size_t len, time_t request_time,
+                             time_t response_time, const CacheMeta *stored, CacheMeta *meta)
+{
+    const char *p = memchr(headers, '\n', len);
+    CacheMeta update;
+
+    init_meta(&update, request_time, response_time);
+    if (p == NULL || !parse_cache_headers(p + 1, headers + len, &update))
+    {
+        /* no new directives: the stored ones still apply */
+        update.max_age = stored->max_age;
+        update.s_maxage = stored->s_maxage;
+        update.stale_while_revalidate = stored->stale_while_revalidate;
+        update.stale_if_error = stored->stale_if_error;
+        update.expires = stored->expires;
+        update.flags = stored->flags;
+    }
+    if (update.last_modified == 0)
+        update.last_modified = stored->last_modified;
+    if (update.etag[0] == '\0')
+        strcpy(update.etag, stored->etag);
+    update.status = stored->status;
+    update.header_len = stored->header_len;
+    update.age_slot = stored->age_slot;
+    /* how the response is stored doesn't change */
+    update.flags = (update.flags & ~(CACHE_CHUNKED | CACHE_COMPRESSED)) |
+                   (stored->flags & (CACHE_CHUNKED | CACHE_COMPRESSED));
+    update.variant = stored->variant;
+    update.object_id = stored->object_id;
+    update.length = stored->length;
+    compute_freshness(&update);
+    *meta = update;
+}
+
+/** @brief Format t as an IMF-fixdate */
+void http_format_date(time_t t, char *buf, size_t len)
+{
+    struct tm tm;
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/** @brief Weak comparison of two entity-tags (RFC 9110 8.8.3.2) */
+static int etag_weak_match(const char *a, size_t alen, const char *b, size_t blen)
+{
+    if (alen >= 2 && strncmp(a, "W/", 2) == 0)
+    {
+        a += 2;
+        alen -= 2;
+    }
+    if (blen >= 2 && strncmp(b, "W/", 2) == 0)
+    {
+        b += 2;
+        blen -= 2;
+    }
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/**
+ * @brief Evaluate a client's conditional GET against a cached response
+ *
+ * @param if_none_match The If-None-Match header, or NULL
+ * @param if_modified_since The If-Modified-Since header, or NULL; ignored
+ *        when If-None-Match is present (RFC 9110 13.2.2)
+ * @return 1 if the client's copy is current and a 304 should be sent
+ */
+int http_not_modified(const CacheMeta *meta, const char *if_none_match,
+                      const char *if_modified_since)
+{
+    if (if_none_match != NULL)
+    {
+        const char *p = if_none_match;
+
+        if (meta->etag[0] == '\0')
+            return 0;
+        while (*p != '\0')
+        {
+            const char *tag, *end;
+
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                p++;
+            tag = p;
+            if (*p == '*')
+                return 1;
+            if (strncmp(p, "W/", 2) == 0)
+                p += 2;
+            if (*p != '"')
+                return 0; /* malformed */
+            end = strchr(p + 1, '"');
+            if (end == NULL)
+                return 0;
+            p = end + 1;
+            if (etag_weak_match(tag, p - tag, meta->etag, strlen(meta->etag)))
+                return 1;
+        }
+        return 0;
+    }
+    if (if_modified_since != NULL && meta->last_modified != 0)
+    {
+        time_t since = http_parse_date(if_modified_since, strlen(if_modified_since));
+        return since != -1 && meta->last_modified <= since;
+    }
+    return 0;
+}
+
+/**
+ * @brief Build a 304 for a cached response
+ *
+ * The 304 repeats the stored headers a 200 would have carried that
+ * describe the representation (RFC 9110 15.4.5), plus the current Age.
+ *
+ * @param stored The stored status line and headers
+ * @param out Buffer of outlen bytes for the response
+ * @return The length of the response in out
+ */
+size_t http_build_not_modified(const char *stored, const CacheMeta *meta, long age,
+                               char *out, size_t outlen)
+{
+    static const char *keep[] = {"Cache-Control", "Content-Location", "Date", "ETag",
+                                 "Expires", "Last-Modified", "Vary"};
+    const char *p = memchr(stored, '\n', meta->header_len), *end = stored + meta->header_len;
+    const char *name, *value;
+    size_t name_len, value_len, n;
+
+    n = snprintf(out, outlen, "HTTP/1.0 304 Not Modified\r\n");
+    if (p != NULL)
+        p++;
+    while (p != NULL && (p = http_next_header(p, end, &name, &name_len, &value, &value_len)) != NULL)
+    {
+        for (size_t i = 0; i < sizeof(keep) / sizeof(keep[0]); i++)
+        {
+            if (http_header_is(name, name_len, keep[i]) &&
+                n + name_len + value_len + 4 < outlen)
+            {
+                n += snprintf(out + n, outlen - n, "%.*s: %.*s\r\n",
+                              (int)name_len, name, (int)value_len, value);
+            }
+        }
+    }
+    n += snprintf(out + n, outlen - n, "Age: %ld\r\n\r\n", age);
+    return n < outlen ? n : outlen - 1;
+}
+
+/**
+ * @brief Remove every header called name from a header block in place
+ *
+ * @return The new length of the block
+ */
+size_t http_strip_header(char *headers, size_t len, const char *name)
+{
+    char *end = headers + len;
+    char *line = memchr(headers, '\n', len);
+
+    if (line == NULL)
+        return len;
+    line++; /* keep the status line */
+    while (line < end)
+    {
+        char *eol = memchr(line, '\n', end - line);
+        char *next = eol == NULL ? end : eol + 1;
+        char *colon = memchr(line, ':', next - line);
+
+        if (colon != NULL && http_header_is(line, colon - line, name))
+        {
+            memmove(line, next, end - next);
+            end -= next - line;
+            continue;
+        }
+        line = next;
+    }
+    return end - headers;
+}
+
+/** @brief Write an Age slot's blank value: spaces (allowed before a
+ *         field value) and a zero */
+static void blank_age_slot(char *slot)
+{
+    memset(slot, ' ', HTTP_AGE_DIGITS - 1);
+    slot[HTTP_AGE_DIGITS - 1] = '0';
+}
+
+/**
+ * @brief Copy a header block with an Age slot added at its end
+ *
+ * A response is stored this way so that a hit only patches the current
+ * age into the slot (http_patch_age()) and sends the headers as they are.
+ * The block must not have an Age header already.
+ *
+ * @param extra Header lines, each ending in CRLF, added before the slot
+ * @param out Room for len + strlen(extra) + HTTP_AGE_SLOT_LEN bytes
+ * @param slot Set to the offset of the slot in out
+ * @return The length of the new block
+ */
+size_t http_add_age_slot(const char *headers, size_t len, const char *extra, char *out,
+                         uint32_t *slot)
+{
+    size_t extra_len = strlen(extra);
+
+    /** the blank line goes and comes back after the slot */
+    while (len > 0 && (headers[len - 1] == '\n' || headers[len - 1] == '\r'))
+        len--;
+    memcpy(out, headers, len);
+    memcpy(out + len, "\r\n", 2);
+    memcpy(out + len + 2, extra, extra_len);
+    len += 2 + extra_len;
+    memcpy(out + len, "Age: ", 5);
+    len += 5;
+    *slot = len;
+    blank_age_slot(out + len);
+    len += HTTP_AGE_DIGITS;
+    memcpy(out + len, "\r\n\r\n", 4);
+    return len + 4;
+}
+
+/** @brief Fill an Age slot with age, right-aligned */
+void http_patch_age(char *headers, uint32_t slot, long age)
+{
+    char *start = headers + slot, *p = start + HTTP_AGE_DIGITS;
+
+    if (age > HTTP_AGE_MAX)
+        age = HTTP_AGE_MAX;
+    do
+    {
+        *--p = '0' + age % 10;
+        age /= 10;
+    } while (age > 0);
+    while (p > start)
+        *--p = ' ';
+}
+
+/**
+ * @brief Collect the field names of every Vary header of a response
+ *
+ * The names are lowercased and joined with commas, in order, so that two
+ * responses varying on the same fields produce the same list.
+ *
+ * @param out Set to the list, "" if the response doesn't vary
+ * @return The number of names, or -1 for "Vary: *" or a list that
+ *         doesn't fit in outlen
+ */
+int http_vary(const char *headers, size_t len, char *out, size_t outlen)
+{
+    const char *p, *end = headers + len;
+    const char *name, *value;
+    size_t name_len, value_len, used = 0;
+    int count = 0;
+
+    out[0] = '\0';
+    if ((p = memchr(headers, '\n', len)) == NULL)
+        return 0;
+    p++;
+    while ((p = http_next_header(p, end, &name, &name_len, &value, &value_len)) != NULL)
+    {
+        if (!http_header_is(name, name_len, "Vary"))
+            continue;
+        const char *v = value, *vend = value + value_len;
+        while (v < vend)
+        {
+            const char *field;
+            size_t field_len;
+
+            while (v < vend && (*v == ',' || *v == ' ' || *v == '\t'))
+                v++;
+            field = v;
+            while (v < vend && *v != ',' && *v != ' ' && *v != '\t')
+                v++;
+            if ((field_len = v - field) == 0)
+                continue;
+            if (field_len == 1 && *field == '*')
+                return -1;
+            if (used + field_len + 2 > outlen)
+                return -1;
+            if (count++ > 0)
+                out[used++] = ',';
+            for (size_t i = 0; i < field_len; i++)
+                out[used++] = tolower((unsigned char)field[i]);
+            out[used] = '\0';
+        }
+    }
+    return count;
+}
+
+/** @brief current_age of RFC 9111 4.2.3 */
+long http_current_age(const CacheMeta *meta, time_t now)
+{
+    long resident_time = now - meta->response_time;
+    return meta->initial_age + (resident_time > 0 ? resident_time : 0);
+}
+
+/**
+ * @brief Whether a cached response may be served without revalidation
+ */
+int http_is_fresh(const CacheMeta *meta, time_t now)
+{
+    if (meta->flags & CACHE_NO_CACHE)
+        return 0;
+    return meta->lifetime > http_current_age(meta, now);
+}
+
+/** @brief Whether a stale response can be revalidated with a conditional GET */
+int http_has_validator(const CacheMeta *meta)
+{
+    return meta->etag[0] != '\0' || meta->last_modified != 0;
+}
+
+/**
+ * @brief Whether a stale response may still be served while it is
+ *        refreshed in the background (RFC 5861 3)
+ */
+int http_stale_while_revalidate(const CacheMeta *meta, time_t now)
+{
+    if (meta->flags & (CACHE_NO_CACHE | CACHE_MUST_REVALIDATE) || meta->stale_while_revalidate < 0)
+        return 0;
+    return http_current_age(meta, now) < (long)meta->lifetime + meta->stale_while_revalidate;
+}
+
+/**
+ * @brief Whether a stale response may be served because the origin
+ *        failed or returned a 5xx (RFC 5861 4)
+ */
+int http_stale_if_error(const CacheMeta *meta, time_t now)
+{
+    if (meta->flags & (CACHE_NO_CACHE | CACHE_MUST_REVALIDATE) || meta->stale_if_error < 0)
+        return 0;
+    return http_current_age(meta, now) < (long)meta->lifetime + meta->stale_if_error;
+}
+
+/**
+ * @brief Find the first header called name
+ *
+ * @param headers The status line and headers
+ * @return 1 and the trimmed value if there is one, 0 (value untouched) otherwise
+ */
+int http_header_value(const char *headers, size_t len, const char *name,
+                      const char **value, size_t *value_len)
+{
+    const char *p = memchr(headers, '\n', len), *end = headers + len;
+    const char *n, *v;
+    size_t n_len, v_len;
+
+    if (p == NULL)
+        return 0;
+    p++;
+    while ((p = http_next_header(p, end, &n, &n_len, &v, &v_len)) != NULL)
+    {
+        if (http_header_is(n, n_len, name))
+        {
+            *value = v;
+            *value_len = v_len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return The Content-Length of a response, or -1 if it has none
+ */
+long http_content_length(const char *headers, size_t len)
+{
+    const char *value;
+    size_t value_len;
+
+    if (!http_header_value(headers, len, "Content-Length", &value, &value_len))
+        return -1;
+    return parse_seconds(value, value_len);
+}
+
+/**
+ * @brief Parse a Range header against a representation of length bytes
+ *        (RFC 9110 14.1)
+ *
+ * Unsatisfiable ranges are dropped and the rest clipped to the length,
+ * then sorted and coalesced where they overlap or touch (RFC 9110 14.3),
+ * so a client can't have the same bytes sent many times over.
+ *
+ * @param value The Range header's value
+ * @param ranges Filled in with up to max ranges, in ascending order
+ * @return The number of satisfiable ranges (0: answer 416), or -1 if the
+ *         header is invalid, asks for too many ranges or for more bytes in
+ *         all than the representation has, and should be ignored
+ */
+int http_parse_range(const char *value, size_t length, HttpRange *ranges, int max)
+{
+    const char *p = value;
+    int n = 0, specs = 0, merged = 0;
+    size_t requested = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+    while (1)
+    {
+        unsigned long long first = 0, last = 0;
+        int has_first = 0, has_last = 0;
+        char *end;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+        if (isdigit((unsigned char)*p))
+        {
+            first = strtoull(p, &end, 10);
+            p = end;
+            has_first = 1;
+        }
+        if (*p++ != '-')
+            return -1;
+        if (isdigit((unsigned char)*p))
+        {
+            last = strtoull(p, &end, 10);
+            p = end;
+            has_last = 1;
+        }
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if ((*p != ',' && *p != '\0') || (!has_first && !has_last) ||
+            (has_first && has_last && last < first))
+            return -1;
+        if (n == max)
+            return -1;
+        specs++;
+
+        if (!has_first)
+        {
+            /** suffix range: the last "last" bytes */
+            if (last == 0 || length == 0)
+                continue;
+            ranges[n].first = last >= length ? 0 : length - last;
+            ranges[n].last = length - 1;
+        }
+        else
+        {
+            if (first >= length)
+                continue;
+            ranges[n].first = first;
+            ranges[n].last = has_last && last < length ? last : length - 1;
+        }
+        requested += ranges[n].last - ranges[n].first + 1;
+        n++;
+    }
+    if (specs == 0 || requested > length)
+        return -1;
+
+    for (int i = 1; i < n; i++)
+    {
+        HttpRange r = ranges[i];
+        int j = i;
+
+        for (; j > 0 && ranges[j - 1].first > r.first; j--)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = r;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (merged > 0 && ranges[i].first <= ranges[merged - 1].last + 1)
+        {
+            if (ranges[i].last > ranges[merged - 1].last)
+                ranges[merged - 1].last = ranges[i].last;
+        }
+        else
+            ranges[merged++] = ranges[i];
+    }
+    return merged;
+}
+
+/**
+ * @brief Whether an If-Range condition holds, so the Range applies
+ *
+ * An entity tag must match strongly; a date must be the Last-Modified.
+ */
+int http_if_range(const CacheMeta *meta, const char *if_range)
+{
+    if (if_range == NULL || *if_range == '\0')
+        return 1;
+    if (*if_range == '"')
+        return meta->etag[0] == '"' && strcmp(meta->etag, if_range) == 0;
+    if (strncmp(if_range, "W/", 2) == 0)
+        return 0;
+    return meta->last_modified != 0 &&
+           http_parse_date(if_range, strlen(if_range)) == meta->last_modified;
+}
+
+/**
+ * @brief Whether a client's Accept-Encoding admits gzip (RFC 9110 12.5.3)
+ *
+ * @param value The Accept-Encoding header, or NULL if there is none
+ */
+int http_accepts_gzip(const char *value)
+{
+    const char *p = value;
+    int gzip = -1, any = 0; /* -1: gzip not listed, "*" decides */
+
+    if (value == NULL)
+        return 0;
+    while (*p != '\0')
+    {
+        const char *coding;
+        size_t len;
+        double q = 1;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        coding = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        len = p - coding;
+        /** parameters: only the weight matters */
+        while (*p != '\0' && *p != ',')
+        {
+            if (*p++ != ';')
+                continue;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                q = strtod(p + 2, NULL);
+        }
+        if (http_header_is(coding, len, "gzip") || http_header_is(coding, len, "x-gzip"))
+            gzip = q > 0;
+        else if (len == 1 && *coding == '*')
+            any = q > 0;
+    }
+    return gzip == -1 ? any : gzip;
+}
+
+/** @brief Whether a Content-Type is text that compresses well */
+static int compressible_type(const char *type, size_t len)
+{
+    static const char *types[] = {"text/", "application/json", "application/javascript",
+                                  "application/xml", "image/svg+xml"};
+    size_t end = 0;
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (len >= strlen(types[i]) && strncasecmp(type, types[i], strlen(types[i])) == 0)
+            return 1;
+    }
+    /** structured syntax suffixes, as in application/ld+json */
+    while (end < len && type[end] != ';' && type[end] != ' ')
+        end++;
+    return (end >= 5 && strncasecmp(type + end - 5, "+json", 5) == 0) ||
+           (end >= 4 && strncasecmp(type + end - 4, "+xml", 4) == 0);
+}
+
+/**
+ * @brief Whether the proxy may gzip a response for the client: a 200 of a
+ *        textual type that the origin hasn't encoded and that isn't marked
+ *        no-transform (RFC 9111 5.2.2.6)
+ */
+int http_compressible(const char *headers, size_t len)
+{
+    const char *p = memchr(headers, '\n', len), *end = headers + len;
+    const char *name, *value;
+    size_t name_len, value_len;
+    int textual = 0;
+
+    if (p == NULL || http_status(headers, len) != 200)
+        return 0;
+    p++;
+    while ((p = http_next_header(p, end, &name, &name_len, &value, &value_len)) != NULL)
+    {
+        if (http_header_is(name, name_len, "Content-Encoding") &&
+            !http_header_is(value, value_len, "identity"))
+            return 0;
+        if (http_header_is(name, name_len, "Content-Range"))
+            return 0;
+        if (http_header_is(name, name_len, "Cache-Control"))
+        {
+            for (size_t i = 0; i + 12 <= value_len; i++)
+            {
+                if (strncasecmp(value + i, "no-transform", 12) == 0)
+                    return 0;
+            }
+        }
+        if (http_header_is(name, name_len, "Content-Type"))
+            textual = compressible_type(value, value_len);
+    }
+    return textual;
+}
+
+/**
+ * @brief Rewrite a response's headers for its body gzipped to body_len bytes
+ *
+ * Content-Length is replaced and Content-Encoding and Vary added (a Vary
+ * the block has already can only be that one, see store_response()). The ETag
+ * becomes weak, since the bytes are no longer the origin's, and
+ * Accept-Ranges is dropped: ranges are only served unencoded. The block
+ * ends with a fresh Age slot, as http_add_age_slot() makes.
+ *
+ * @param out Buffer of outlen bytes for the new status line and headers
+ * @param slot Set to the offset of the Age slot in out
+ * @return The length of the new block, or 0 if it doesn't fit
+ */
+size_t http_encode_headers(const char *headers, size_t len, size_t body_len,
+                           char *out, size_t outlen, uint32_t *slot)
+{
+    const char *p = memchr(headers, '\n', len), *end = headers + len;
+    const char *name, *value;
+    size_t name_len, value_len, n;
+
+    if (p == NULL || (n = ++p - headers) >= outlen)
+        return 0;
+    memcpy(out, headers, n);
+    while ((p = http_next_header(p, end, &name, &name_len, &value, &value_len)) != NULL)
+    {
+        if (http_header_is(name, name_len, "Content-Length") ||
+            http_header_is(name, name_len, "Content-Encoding") ||
+            http_header_is(name, name_len, "Accept-Ranges") ||
+            http_header_is(name, name_len, "Vary") ||
+            http_header_is(name, name_len, "Age"))
+            continue;
+        if (http_header_is(name, name_len, "ETag") && value_len > 0 && *value == '"')
+            n += snprintf(out + n, outlen - n, "ETag: W/%.*s\r\n", (int)value_len, value);
+        else
+            n += snprintf(out + n, outlen - n, "%.*s: %.*s\r\n",
+                          (int)name_len, name, (int)value_len, value);
+        if (n >= outlen)
+            return 0;
+    }
+    n += snprintf(out + n, outlen - n, "Content-Encoding: gzip\r\nContent-Length: %zu\r\n"
+                                       "Vary: Accept-Encoding\r\nAge: ",
+                  body_len);
+    if (n + HTTP_AGE_DIGITS + 4 >= outlen)
+        return 0;
+    *slot = n;
+    blank_age_slot(out + n);
+    memcpy(out + n + HTTP_AGE_DIGITS, "\r\n\r\n", 4);
+    return n + HTTP_AGE_DIGITS + 4;
+}
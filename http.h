@@ -0,0 +1,77 @@
+/**
+ * @file http.h
+ * @brief HTTP header parsing for the cache: freshness, cacheability and
+ *        conditional requests
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+#include "cache.h"
+
+/* Heuristic freshness (RFC 9111 4.2.2) for responses with no explicit
+ * lifetime: a tenth of the time since Last-Modified, capped at a day,
+ * or HEURISTIC_DEFAULT seconds if there is no Last-Modified either. */
+#define HEURISTIC_FRACTION 10
+#define HEURISTIC_MAX 86400
+#define HEURISTIC_DEFAULT 300
+
+/* Longest normalized Vary list a response may have and still be cached */
+#define VARY_MAX 256
+
+/* Most ranges served from one Range header; more and the whole
+ * response is sent instead */
+#define HTTP_MAX_RANGES 16
+
+/* Stored headers end with "Age: " and a slot of HTTP_AGE_DIGITS
+ * characters, patched on every hit; HTTP_AGE_SLOT_LEN is the most the
+ * slot adds to a header block. Ages are capped at HTTP_AGE_MAX
+ * (RFC 9111 1.2.2). */
+#define HTTP_AGE_DIGITS 10
+#define HTTP_AGE_SLOT_LEN (2 + 5 + HTTP_AGE_DIGITS + 4)
+#define HTTP_AGE_MAX 2147483648L
+
+/* A byte range, both ends inclusive */
+typedef struct
+{
+    size_t first;
+    size_t last;
+} HttpRange;
+
+const char *http_next_header(const char *p, const char *end,
+                             const char **name, size_t *name_len,
+                             const char **value, size_t *value_len);
+int http_header_is(const char *name, size_t name_len, const char *expected);
+int http_header_value(const char *headers, size_t len, const char *name,
+                      const char **value, size_t *value_len);
+long http_content_length(const char *headers, size_t len);
+time_t http_parse_date(const char *s, size_t len);
+int http_status(const char *headers, size_t len);
+int http_parse_response(const char *headers, size_t len, time_t request_time,
+                        time_t response_time, CacheMeta *meta);
+void http_parse_not_modified(const char *headers, size_t len, time_t request_time,
+                             time_t response_time, const CacheMeta *stored, CacheMeta *meta);
+void http_format_date(time_t t, char *buf, size_t len);
+int http_not_modified(const CacheMeta *meta, const char *if_none_match,
+                      const char *if_modified_since);
+size_t http_build_not_modified(const char *stored, const CacheMeta *meta, long age,
+                               char *out, size_t outlen);
+size_t http_strip_header(char *headers, size_t len, const char *name);
+size_t http_add_age_slot(const char *headers, size_t len, const char *extra, char *out,
+                         uint32_t *slot);
+void http_patch_age(char *headers, uint32_t slot, long age);
+int http_vary(const char *headers, size_t len, char *out, size_t outlen);
+int http_parse_range(const char *value, size_t length, HttpRange *ranges, int max);
+int http_if_range(const CacheMeta *meta, const char *if_range);
+int http_accepts_gzip(const char *value);
+int http_compressible(const char *headers, size_t len);
+size_t http_encode_headers(const char *headers, size_t len, size_t body_len,
+                           char *out, size_t outlen, uint32_t *slot);
+long http_current_age(const CacheMeta *meta, time_t now);
+int http_is_fresh(const CacheMeta *meta, time_t now);
+int http_has_validator(const CacheMeta *meta);
+int http_stale_while_revalidate(const CacheMeta *meta, time_t now);
+int http_stale_if_error(const CacheMeta *meta, time_t now);
+
+#endif /* __HTTP_H__ */
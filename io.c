@@ -0,0 +1,145 @@
+/**
+ * @file io.c
+ * @brief Socket deadlines: connecting with a timeout, and read and write
+ *        timeouts on connected sockets
+ *
+ * Timeouts are in seconds; 0 means none. A read or write past its
+ * timeout fails with EAGAIN, a connect with ETIMEDOUT; io_timed_out()
+ * tells these apart from other errors.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "io.h"
+
+/** @brief Milliseconds on the monotonic clock */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Wait for a non-blocking connect() to finish
+ *
+ * @param deadline In now_ms() time, or -1 for none
+ * @return 0 once connected, -1 with errno set otherwise
+ */
+static int wait_connected(int fd, long long deadline)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    socklen_t len = sizeof(int);
+    int rc, err;
+
+    do
+    {
+        long long left = deadline < 0 ? -1 : deadline - now_ms();
+        if (deadline >= 0 && left <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        rc = poll(&pfd, 1, (int)left);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return -1;
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Look up the addresses of host:port, as open_clientfd() does
+ *
+ * @return The list, freed with freeaddrinfo(), or NULL with errno set to
+ *         EHOSTUNREACH if host doesn't resolve
+ */
+struct addrinfo *io_resolve(const char *host, const char *port)
+{
+    struct addrinfo hints, *list;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &list) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+    return list;
+}
+
+/**
+ * @brief Connect to one of the addresses in list, giving up after timeout
+ *        seconds
+ *
+ * Like open_clientfd(), each address is tried in turn, but all of them
+ * share the one deadline, and the caller learns why it failed.
+ *
+ * @return A connected, blocking socket, or -1 with errno set (ETIMEDOUT
+ *         if the deadline passed)
+ */
+int io_connect(struct addrinfo *list, int timeout)
+{
+    struct addrinfo *p;
+    long long deadline = timeout > 0 ? now_ms() + timeout * 1000LL : -1;
+    int fd = -1, err = ECONNREFUSED;
+
+    for (p = list; p != NULL; p = p->ai_next)
+    {
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+        {
+            err = errno;
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 ||
+            (errno == EINPROGRESS && wait_connected(fd, deadline) == 0))
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            break;
+        }
+        err = errno;
+        close(fd);
+        fd = -1;
+        if (err == ETIMEDOUT)
+            break; /* the deadline covers every address */
+    }
+    if (fd < 0)
+        errno = err;
+    return fd;
+}
+
+/**
+ * @brief Bound each read (SO_RCVTIMEO) or write (SO_SNDTIMEO) on fd
+ *
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int io_set_timeout(int fd, int option, int timeout)
+{
+    struct timeval tv = {timeout, 0};
+
+    return setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+/** @brief Whether the last failed socket call failed for its timeout */
+int io_timed_out(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT;
+}
@@ -0,0 +1,16 @@
+/**
+ * @file io.h
+ * @brief Socket deadlines: connecting with a timeout, and read and write
+ *        timeouts on connected sockets
+ */
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <netdb.h>
+
+struct addrinfo *io_resolve(const char *host, const char *port);
+int io_connect(struct addrinfo *list, int timeout);
+int io_set_timeout(int fd, int option, int timeout);
+int io_timed_out(void);
+
+#endif /* __IO_H__ */
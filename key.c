@@ -0,0 +1,260 @@
+/**
+ * @file key.c
+ * @brief Canonical cache keys, so that equivalent URLs share one entry
+ *
+ * A key is the URL normalized as in RFC 3986 6.2.2 and laid out as
+ *
+ *   host (lowercase) | '\0' | port (2 bytes, big endian) | path [ '?' query ]
+ *
+ * The scheme is always http and is left out. In the path and query,
+ * percent-encoded unreserved characters are decoded, the remaining escapes
+ * get uppercase hex digits, and dot segments are removed; the fragment is
+ * dropped. Query parameters named in KeyOptions are dropped as well, and
+ * the rest may be sorted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "key.h"
+
+/* Longest key key_from_url() builds, leaving room for the suffixes */
+#define KEY_ROOM (CACHE_KEY_MAX - KEY_VARIANT_LEN - KEY_CHUNK_LEN - KEY_ENCODING_LEN)
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/**
+ * @brief Normalize the percent-encoding of len bytes of src into dst
+ *
+ * dst needs len bytes; the result is never longer than the input.
+ *
+ * @return The length written
+ */
+static size_t normalize_escapes(const char *src, size_t len, char *dst)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int hi, lo;
+
+        if (src[i] == '%' && i + 2 < len && (hi = hex_value(src[i + 1])) >= 0 &&
+            (lo = hex_value(src[i + 2])) >= 0)
+        {
+            int c = hi * 16 + lo;
+            if (unreserved(c))
+                dst[out++] = c;
+            else
+            {
+                dst[out++] = '%';
+                dst[out++] = hex[hi];
+                dst[out++] = hex[lo];
+            }
+            i += 2;
+        }
+        else
+            dst[out++] = src[i];
+    }
+    return out;
+}
+
+/**
+ * @brief Remove "." and ".." segments (RFC 3986 5.2.4)
+ *
+ * @param path The path, starting with '/'; it is modified
+ * @param len Its length
+ * @param dst Where the result goes, at most len bytes
+ * @return The length written
+ */
+static size_t remove_dot_segments(char *path, size_t len, char *dst)
+{
+    char *in = path, *end = path + len;
+    size_t out = 0;
+
+    while (in < end)
+    {
+        size_t left = end - in;
+
+        if (left >= 3 && strncmp(in, "/./", 3) == 0)
+            in += 2;
+        else if (left == 2 && strncmp(in, "/.", 2) == 0)
+        {
+            in += 1;
+            *in = '/';
+        }
+        else if ((left >= 4 && strncmp(in, "/../", 4) == 0) ||
+                 (left == 3 && strncmp(in, "/..", 3) == 0))
+        {
+            if (left == 3)
+            {
+                in += 2;
+                *in = '/';
+            }
+            else
+                in += 3;
+            /** drop the last output segment and its leading slash */
+            while (out > 0 && dst[out - 1] != '/')
+                out--;
+            if (out > 0)
+                out--;
+        }
+        else
+        {
+            /** move the first segment, with its leading slash, to the output */
+            do
+                dst[out++] = *in++;
+            while (in < end && *in != '/');
+        }
+    }
+    return out;
+}
+
+static int compare_params(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int ignored_param(const char *param, const KeyOptions *opts)
+{
+    size_t name_len = strcspn(param, "=");
+
+    for (int i = 0; i < opts->nignored; i++)
+    {
+        if (strlen(opts->ignored[i]) == name_len &&
+            strncmp(param, opts->ignored[i], name_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Append the normalized query to the key
+ *
+ * @param query The query, without the '?', in a buffer that is modified
+ * @return 0 on success, -1 if it doesn't fit
+ */
+static int append_query(CacheKey *key, char *query, const KeyOptions *opts)
+{
+    char *params[KEY_MAX_PARAMS];
+    int nparams = 0;
+    char *saveptr, *param;
+
+    for (param = strtok_r(query, "&", &saveptr); param != NULL; param = strtok_r(NULL, "&", &saveptr))
+    {
+        if (ignored_param(param, opts))
+            continue;
+        if (nparams == KEY_MAX_PARAMS)
+            return -1;
+        params[nparams++] = param;
+    }
+    if (opts->sort_query)
+        qsort(params, nparams, sizeof(char *), compare_params);
+
+    for (int i = 0; i < nparams; i++)
+    {
+        size_t n = strlen(params[i]);
+        if (key->len + n + 1 > KEY_ROOM)
+            return -1;
+        key->data[key->len++] = i == 0 ? '?' : '&';
+        memcpy(key->data + key->len, params[i], n);
+        key->len += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Build the canonical key of http://host:port/path
+ *
+ * @param port The port as given, "" for the default
+ * @param path Everything after the first '/', query included
+ * @return 0 on success, -1 if the URL can't be normalized (bad port, too
+ *         long, too many parameters); the caller should use it verbatim
+ */
+int key_from_url(CacheKey *key, const char *host, const char *port,
+                 const char *path, const KeyOptions *opts)
+{
+    char buf[CACHE_KEY_MAX];
+    size_t host_len = strlen(host), path_len, n;
+    long port_num = 80;
+    char *query;
+
+    if (*port != '\0')
+    {
+        char *end;
+        port_num = strtol(port, &end, 10);
+        if (*end != '\0' || port_num <= 0 || port_num > 65535)
+            return -1;
+    }
+    path_len = strcspn(path, "#");
+    if (host_len + 3 + path_len + 1 > KEY_ROOM)
+        return -1;
+
+    for (size_t i = 0; i < host_len; i++)
+        key->data[i] = tolower((unsigned char)host[i]);
+    key->data[host_len] = '\0';
+    key->data[host_len + 1] = port_num >> 8;
+    key->data[host_len + 2] = port_num & 0xff;
+    key->len = host_len + 3;
+
+    /** the path, always starting with '/', and the query, each normalized */
+    buf[0] = '/';
+    n = 1 + normalize_escapes(path, path_len, buf + 1);
+    buf[n] = '\0';
+    if ((query = memchr(buf, '?', n)) != NULL)
+        *query++ = '\0';
+    key->len += remove_dot_segments(buf, strlen(buf), key->data + key->len);
+    if (query != NULL && append_query(key, query, opts) < 0)
+        return -1;
+    cache_key_hash(key);
+    return 0;
+}
+
+/**
+ * @brief Turn a key into the key of one of its Vary variants
+ */
+void key_add_variant(CacheKey *key, int slot)
+{
+    /** no URL contains '\0', so this can't collide with another URL's key */
+    key->data[key->len++] = '\0';
+    key->data[key->len++] = 'v';
+    key->data[key->len++] = slot;
+    cache_key_hash(key);
+}
+
+/**
+ * @brief Turn the key of a chunked object (or of one of its variants) into
+ *        the key of its chunk number index
+ */
+void key_add_chunk(CacheKey *key, uint32_t index)
+{
+    key->data[key->len++] = '\0';
+    key->data[key->len++] = 'c';
+    for (int shift = 24; shift >= 0; shift -= 8)
+        key->data[key->len++] = index >> shift;
+    cache_key_hash(key);
+}
+
+/**
+ * @brief Turn a key into the key of the gzip-encoded copy of its response
+ */
+void key_add_encoding(CacheKey *key)
+{
+    key->data[key->len++] = '\0';
+    key->data[key->len++] = 'z';
+    cache_key_hash(key);
+}
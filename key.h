@@ -0,0 +1,34 @@
+/**
+ * @file key.h
+ * @brief Canonical cache keys, so that equivalent URLs share one entry
+ */
+#ifndef __KEY_H__
+#define __KEY_H__
+
+#include "cache.h"
+
+/* Most query parameters left out of keys (-i), and most parameters a
+ * URL may have and still be normalized */
+#define KEY_MAX_IGNORED 16
+#define KEY_MAX_PARAMS 256
+
+/* Bytes key_add_variant(), key_add_chunk() and key_add_encoding()
+ * append; keys leave room for all three */
+#define KEY_VARIANT_LEN 3
+#define KEY_CHUNK_LEN 6
+#define KEY_ENCODING_LEN 2
+
+typedef struct
+{
+    int sort_query; /* order query parameters, so ?a=1&b=2 matches ?b=2&a=1 */
+    int nignored;
+    const char *ignored[KEY_MAX_IGNORED]; /* e.g. utm_source */
+} KeyOptions;
+
+int key_from_url(CacheKey *key, const char *host, const char *port,
+                 const char *path, const KeyOptions *opts);
+void key_add_variant(CacheKey *key, int slot);
+void key_add_chunk(CacheKey *key, uint32_t index);
+void key_add_encoding(CacheKey *key);
+
+#endif /* __KEY_H__ */
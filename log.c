@@ -0,0 +1,254 @@
+/**
+ * @file log.c
+ * @brief Asynchronous logging: each thread appends lines to its own ring
+ *        buffer, and a background thread writes them out in batches
+ *
+ * Each ring has a single producer, the thread that owns it, and a single
+ * consumer, the drain thread, so appending takes no lock: the owner moves
+ * head once a whole line is in, the drain thread moves tail once it has
+ * copied the lines out. A ring whose thread has exited is handed to the
+ * next new thread rather than freed, so thread-per-connection doesn't
+ * mean a ring per connection.
+ *
+ * Lines look like
+ *
+ *   1700000000.123 4242 info <message>
+ *
+ * with the time in seconds and the pid of the process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+typedef struct LogRing LogRing;
+struct LogRing
+{
+    atomic_size_t head; /* bytes ever appended; moved by the owner */
+    atomic_size_t tail; /* bytes ever drained; moved by the drain thread */
+    atomic_int in_use;  /* owned by a live thread */
+    LogRing *next;
+    char data[LOG_RING_SIZE];
+};
+
+volatile int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+/* All rings ever made; only pushed to, never unlinked, except by a forked
+ * child before it starts any threads */
+static _Atomic(LogRing *) rings = NULL;
+static atomic_ulong dropped = 0;
+static __thread LogRing *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/* One consumer at a time: the drain thread, or a log_flush() caller */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = STDOUT_FILENO;
+static pid_t drain_pid = 0; /* the process's pid, once log_start() has run */
+
+/**
+ * @return The level called name, or -1 if there is none
+ */
+int log_parse_level(const char *name)
+{
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/** @brief Thread exit: leave the ring (and what's left in it) for reuse */
+static void release_ring(void *ring)
+{
+    atomic_store(&((LogRing *)ring)->in_use, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * @brief The calling thread's ring: a free one if there is any, else a new one
+ *
+ * @return The ring, or NULL if there's no memory for one
+ */
+static LogRing *get_ring(void)
+{
+    LogRing *ring;
+
+    if (my_ring != NULL)
+        return my_ring;
+    pthread_once(&key_once, make_key);
+    for (ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+    {
+        int free = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &free, 1))
+            break;
+    }
+    if (ring == NULL)
+    {
+        if ((ring = malloc(sizeof(LogRing))) == NULL)
+            return NULL;
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->in_use, 1);
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+            ;
+    }
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Format a line and append it to the calling thread's ring
+ *
+ * Use LOG(), which skips this for levels that are off. A full ring drops
+ * the line rather than wait.
+ */
+void log_write(int level, const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
+    struct timespec ts;
+    LogRing *ring;
+    va_list ap;
+    size_t len, head, at;
+    int n;
+
+    if ((ring = get_ring()) == NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    n = snprintf(line, sizeof(line), "%ld.%03ld %d %s ", (long)ts.tv_sec,
+                 ts.tv_nsec / 1000000, (int)(drain_pid ? drain_pid : getpid()),
+                 level_names[level]);
+    va_start(ap, fmt);
+    n += vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    len = (size_t)n < sizeof(line) - 1 ? (size_t)n : sizeof(line) - 1;
+    if (len == 0 || line[len - 1] != '\n')
+        line[len++] = '\n';
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) + len > LOG_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    at = head % LOG_RING_SIZE;
+    if (at + len <= LOG_RING_SIZE)
+        memcpy(ring->data + at, line, len);
+    else
+    {
+        memcpy(ring->data + at, line, LOG_RING_SIZE - at);
+        memcpy(ring->data, line + (LOG_RING_SIZE - at), len - (LOG_RING_SIZE - at));
+    }
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0 && (n = write(log_fd, buf, len)) > 0)
+    {
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Write out everything appended so far, one write() per ring
+ */
+void log_flush(void)
+{
+    static char batch[LOG_RING_SIZE];
+    unsigned long lost;
+
+    pthread_mutex_lock(&drain_mutex);
+    for (LogRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t len = atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+        size_t at = tail % LOG_RING_SIZE;
+
+        if (len == 0)
+            continue;
+        if (at + len <= LOG_RING_SIZE)
+            memcpy(batch, ring->data + at, len);
+        else
+        {
+            memcpy(batch, ring->data + at, LOG_RING_SIZE - at);
+            memcpy(batch + (LOG_RING_SIZE - at), ring->data, len - (LOG_RING_SIZE - at));
+        }
+        atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+        write_all(batch, len);
+    }
+    if ((lost = atomic_exchange(&dropped, 0)) > 0)
+    {
+        char note[64];
+        write_all(note, snprintf(note, sizeof(note), "log: %lu lines dropped\n", lost));
+    }
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *drain(void *vargp)
+{
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(LOG_FLUSH_US);
+        log_flush();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start writing the log to fd in the background
+ *
+ * Threads don't survive fork(): call it again in each child, before it
+ * starts any. Calls after the first in a process do nothing.
+ */
+void log_start(int fd)
+{
+    pthread_t tid;
+    pid_t pid = getpid();
+    LogRing *ring, *next;
+
+    if (drain_pid == pid)
+        return;
+    /** a child: the rings of the parent's other threads have no owner
+     *  here, and what is pending in them is the parent's to write */
+    if (drain_pid != 0)
+    {
+        for (ring = atomic_load(&rings); ring != NULL; ring = next)
+        {
+            next = ring->next;
+            if (ring != my_ring)
+                free(ring);
+        }
+        if (my_ring != NULL)
+        {
+            atomic_store(&my_ring->tail, atomic_load(&my_ring->head));
+            my_ring->next = NULL;
+        }
+        atomic_store(&rings, my_ring);
+        atomic_store(&dropped, 0);
+    }
+    drain_pid = pid;
+    log_fd = fd;
+    /** the parent's drain thread may have held it at fork() */
+    pthread_mutex_init(&drain_mutex, NULL);
+    pthread_create(&tid, NULL, drain, NULL);
+}
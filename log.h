@@ -0,0 +1,39 @@
+/**
+ * @file log.h
+ * @brief Asynchronous logging: each thread appends lines to its own ring
+ *        buffer, and a background thread writes them out in batches
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdarg.h>
+
+/* Levels; a message is kept if its level is at most log_level */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2 /* the access log */
+#define LOG_LEVEL_DEBUG 3
+
+/* Bytes buffered per thread; lines that don't fit are dropped, and counted */
+#define LOG_RING_SIZE (64 * 1024)
+/* Longest line, longer ones are cut */
+#define LOG_LINE_MAX 1024
+/* Microseconds between flushes */
+#define LOG_FLUSH_US 10000
+
+extern volatile int log_level;
+
+/* Check the level before formatting anything */
+#define LOG(level, ...)                   \
+    do                                    \
+    {                                     \
+        if ((level) <= log_level)         \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+int log_parse_level(const char *name);
+void log_start(int fd);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+
+#endif /* __LOG_H__ */
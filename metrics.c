@@ -0,0 +1,275 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms, kept per thread in memory shared
+ *        by all the proxy's processes and summed when scraped
+ *
+ * Each thread claims a slot the first time it records something and gives
+ * it back when it exits; the counts stay in the slot for the next owner,
+ * so sums only ever grow. Slots of a process that died without giving them
+ * back are reclaimed. Updates are atomic adds to the thread's own slot:
+ * its cache lines are never shared with another writer, except in the
+ * overflow slot.
+ *
+ * The region is mapped before the prefork workers are started, so a scrape
+ * of any process sees them all. Output is the Prometheus text format.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+#define SUB_BUCKETS (1 << METRICS_SUB_BITS)
+
+typedef struct
+{
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+    _Atomic uint64_t sum; /* microseconds */
+    _Atomic uint64_t count;
+} Histogram;
+
+typedef struct
+{
+    atomic_int owner; /* pid of the process whose thread holds it, 0 if free */
+    _Atomic int64_t counters[METRIC_COUNTERS];
+    Histogram histograms[METRIC_HISTOGRAMS];
+} __attribute__((aligned(64))) MetricsSlot;
+
+static MetricsSlot *slots = NULL;
+static __thread MetricsSlot *my_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static const struct
+{
+    const char *name;
+    const char *type;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    {"proxy_requests_total", "counter", "Requests handled."},
+    {"proxy_cache_hits_total", "counter", "Requests answered from the cache."},
+    {"proxy_cache_misses_total", "counter", "Requests that went to the origin."},
+    {"proxy_sent_bytes_total", "counter", "Bytes written to clients."},
+    {"proxy_origin_errors_total", "counter", "Origins that could not be reached or failed."},
+    {"proxy_origin_timeouts_total", "counter", "Origins that missed a deadline."},
+    {"proxy_connections", "gauge", "Connections in flight."},
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAMS] = {
+    {"proxy_request_duration_seconds", "Time from accept to the last byte sent."},
+    {"proxy_origin_connect_seconds", "Time to connect to the origin."},
+    {"proxy_origin_first_byte_seconds", "Time from sending a request to the origin to its first line."},
+};
+
+/**
+ * @brief Map the slots; call before forking, so the children share them
+ *
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int metrics_init(void)
+{
+    void *p = mmap(NULL, sizeof(MetricsSlot) * METRICS_SLOTS, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        return -1;
+    slots = p; /* zeroed by mmap */
+    return 0;
+}
+
+/** @brief Microseconds on the monotonic clock */
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void release_slot(void *slot)
+{
+    atomic_store(&((MetricsSlot *)slot)->owner, 0);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+/**
+ * @brief The calling thread's slot: a free one, one left by a dead process,
+ *        or the shared overflow slot
+ */
+static MetricsSlot *get_slot(void)
+{
+    int pid = getpid();
+
+    if (my_slot != NULL)
+        return my_slot;
+    pthread_once(&key_once, make_key);
+    /** free slots first: checking on owners takes a system call each */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < METRICS_SLOTS - 1; i++)
+        {
+            int owner = atomic_load(&slots[i].owner);
+            if ((owner == 0 || (pass == 1 && kill(owner, 0) < 0 && errno == ESRCH)) &&
+                atomic_compare_exchange_strong(&slots[i].owner, &owner, pid))
+            {
+                my_slot = &slots[i];
+                pthread_setspecific(slot_key, my_slot);
+                return my_slot;
+            }
+        }
+    }
+    my_slot = &slots[METRICS_SLOTS - 1];
+    return my_slot;
+}
+
+void metrics_add(int counter, int64_t n)
+{
+    if (slots != NULL)
+        atomic_fetch_add_explicit(&get_slot()->counters[counter], n, memory_order_relaxed);
+}
+
+/**
+ * @brief The bucket of a value: exact below 2^METRICS_SUB_BITS, then
+ *        SUB_BUCKETS per power of two
+ */
+static int bucket_of(uint64_t v)
+{
+    int exp, b;
+
+    if (v < SUB_BUCKETS)
+        return v;
+    exp = 63 - __builtin_clzll(v);
+    b = ((exp - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+        (int)((v >> (exp - METRICS_SUB_BITS)) & (SUB_BUCKETS - 1));
+    return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+/** @brief The largest value in bucket b */
+static uint64_t bucket_limit(int b)
+{
+    int group = b >> METRICS_SUB_BITS, shift;
+
+    if (group == 0)
+        return b;
+    shift = group - 1;
+    return (((uint64_t)(SUB_BUCKETS + (b & (SUB_BUCKETS - 1))) + 1) << shift) - 1;
+}
+
+void metrics_observe(int histogram, uint64_t usec)
+{
+    Histogram *h;
+
+    if (slots == NULL)
+        return;
+    h = &get_slot()->histograms[histogram];
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Append to buf as snprintf() would, keeping track of the length
+ */
+#define APPEND(...)                                                      \
+    do                                                                   \
+    {                                                                    \
+        if (len < size)                                                  \
+            len += snprintf(buf + len, size - len, __VA_ARGS__);         \
+    } while (0)
+
+/**
+ * @brief Write every metric, summed over the slots, in the Prometheus text
+ *        format, with the cache's own counters
+ *
+ * Empty histogram buckets are left out; the cumulative counts make them
+ * redundant.
+ *
+ * @return The length of the output, which is cut short if it reaches size
+ */
+size_t metrics_render(char *buf, size_t size, CacheList *cache)
+{
+    size_t len = 0;
+    CacheStats stats;
+
+    for (int c = 0; c < METRIC_COUNTERS; c++)
+    {
+        int64_t total = 0;
+        for (int i = 0; slots != NULL && i < METRICS_SLOTS; i++)
+            total += atomic_load_explicit(&slots[i].counters[c], memory_order_relaxed);
+        APPEND("# HELP %s %s\n# TYPE %s %s\n%s %lld\n", counter_info[c].name, counter_info[c].help,
+               counter_info[c].name, counter_info[c].type, counter_info[c].name, (long long)total);
+    }
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++)
+    {
+        const char *name = histogram_info[h].name;
+        uint64_t cumulative = 0, sum = 0, count = 0;
+
+        APPEND("# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[h].help, name);
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            uint64_t n = 0;
+            for (int i = 0; slots != NULL && i < METRICS_SLOTS; i++)
+                n += atomic_load_explicit(&slots[i].histograms[h].buckets[b], memory_order_relaxed);
+            if (n == 0)
+                continue;
+            cumulative += n;
+            APPEND("%s_bucket{le=\"%.6f\"} %llu\n", name, bucket_limit(b) / 1e6,
+                   (unsigned long long)cumulative);
+        }
+        for (int i = 0; slots != NULL && i < METRICS_SLOTS; i++)
+        {
+            sum += atomic_load_explicit(&slots[i].histograms[h].sum, memory_order_relaxed);
+            count += atomic_load_explicit(&slots[i].histograms[h].count, memory_order_relaxed);
+        }
+        /** +Inf uses count, which may have moved on from the buckets read above */
+        APPEND("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", name,
+               (unsigned long long)(count > cumulative ? count : cumulative), name, sum / 1e6,
+               name, (unsigned long long)(count > cumulative ? count : cumulative));
+    }
+
+    cache_stats(cache, &stats);
+    APPEND("# HELP proxy_cache_lookups_total Cache lookups, chunks and variants included.\n"
+           "# TYPE proxy_cache_lookups_total counter\n"
+           "proxy_cache_lookups_total{result=\"hit\"} %llu\n"
+           "proxy_cache_lookups_total{result=\"miss\"} %llu\n",
+           (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+    APPEND("# HELP proxy_cache_insertions_total Objects stored.\n"
+           "# TYPE proxy_cache_insertions_total counter\n"
+           "proxy_cache_insertions_total %llu\n"
+           "# HELP proxy_cache_evictions_total Objects evicted to make room.\n"
+           "# TYPE proxy_cache_evictions_total counter\n"
+           "proxy_cache_evictions_total %llu\n",
+           (unsigned long long)stats.insertions, (unsigned long long)stats.evictions);
+    APPEND("# HELP proxy_cache_objects Objects in the cache.\n"
+           "# TYPE proxy_cache_objects gauge\n"
+           "proxy_cache_objects %ld\n"
+           "# HELP proxy_cache_bytes Bytes of cache blocks in use.\n"
+           "# TYPE proxy_cache_bytes gauge\n"
+           "proxy_cache_bytes %zu\n"
+           "# HELP proxy_cache_budget_bytes The cache budget.\n"
+           "# TYPE proxy_cache_budget_bytes gauge\n"
+           "proxy_cache_budget_bytes %zu\n"
+           "# HELP proxy_cache_stored_bytes Bytes of cached responses, as stored.\n"
+           "# TYPE proxy_cache_stored_bytes gauge\n"
+           "proxy_cache_stored_bytes %zu\n"
+           "# HELP proxy_cache_raw_bytes Bytes of cached responses, uncompressed.\n"
+           "# TYPE proxy_cache_raw_bytes gauge\n"
+           "proxy_cache_raw_bytes %zu\n",
+           stats.count, stats.size, stats.max_size, stats.stored_bytes, stats.raw_bytes);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file metrics.h
+ * @brief Counters and latency histograms, kept per thread in memory shared
+ *        by all the proxy's processes and summed when scraped
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cache.h"
+
+/* Counters; METRIC_CONNECTIONS goes down as well as up */
+#define METRIC_REQUESTS 0
+#define METRIC_HITS 1           /* requests answered from the cache */
+#define METRIC_MISSES 2         /* requests that went to the origin */
+#define METRIC_BYTES_SENT 3     /* to clients */
+#define METRIC_ORIGIN_ERRORS 4  /* origin unreachable or failing */
+#define METRIC_ORIGIN_TIMEOUTS 5
+#define METRIC_CONNECTIONS 6    /* in flight */
+#define METRIC_COUNTERS 7
+
+/* Latency histograms, in microseconds */
+#define METRIC_REQUEST_TIME 0    /* accept to last byte */
+#define METRIC_CONNECT_TIME 1    /* connecting to the origin */
+#define METRIC_FIRST_BYTE_TIME 2 /* request sent to the response's first line */
+#define METRIC_HISTOGRAMS 3
+
+/* Slots for threads (across all processes) with their own counters; the
+ * rest share the last one */
+#define METRICS_SLOTS 256
+
+/* HDR-style buckets: each power of two split in 2^METRICS_SUB_BITS, up to
+ * 2^METRICS_MAX_EXP microseconds (about 18 minutes) */
+#define METRICS_SUB_BITS 2
+#define METRICS_MAX_EXP 30
+#define METRICS_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS)
+
+int metrics_init(void);
+uint64_t metrics_now(void);
+void metrics_add(int counter, int64_t n);
+void metrics_observe(int histogram, uint64_t usec);
+size_t metrics_render(char *buf, size_t size, CacheList *cache);
+
+#endif /* __METRICS_H__ */
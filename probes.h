@@ -0,0 +1,46 @@
+/**
+ * @file probes.h
+ * @brief USDT probes (provider "proxy") at the proxy's key events
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus a
+ * note in the ELF file, so it costs nothing until a tracer such as
+ * bpftrace attaches; scripts using them are in bpf/. Without the header,
+ * or with -DNO_PROBES, the probes compile to nothing. List them with
+ *
+ *   bpftrace -l 'usdt:./proxy:proxy:*'
+ *
+ * Probes and their arguments:
+ *
+ *   request__start   clientfd
+ *   request__done    url, hit (0 or 1), microseconds since accept
+ *   cache__hit       key, key length, object size
+ *   cache__miss      key, key length
+ *   cache__insert    key, key length, object size
+ *   cache__evict     key hash, object size
+ *   origin__connect__start  host, port
+ *   origin__connect__done   host, fd (-1 on failure)
+ *   relay__bytes     clientfd, bytes written
+ *
+ * Keys start with the host, '\0'-terminated, so str() of one gives the host.
+ */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(proxy, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* __PROBES_H__ */
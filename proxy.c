@@ -12,12 +12,52 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <sys/prctl.h>
 #include "csapp.h"
+#include "cache.h"
+#include "handoff.h"
+#include "http.h"
+#include "key.h"
+#include "config.h"
+#include "gzip.h"
+#include "io.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_HEADERS 100
+/* Seconds a replaced proxy waits for in-flight connections to finish */
+#define DRAIN_TIMEOUT 30
+
+/* Command-line settings (-m, -M, -o, -s, -w, -p, -z, -l), applied over the config file */
+#define MAX_OVERRIDES 16
+
+/* After a budget shrink, objects evicted per shard per step, and the pause
+ * between steps, so clients keep getting the cache lock */
+#define TRIM_BATCH 32
+#define TRIM_PAUSE_US 1000
+
+/* Background refreshes for stale-while-revalidate, per process */
+#define REFRESH_WORKERS 2
+#define REFRESH_QUEUE 64
+/* Seconds before an unfinished refresh claim may be taken over */
+#define REFRESH_CLAIM_TIMEOUT 30
+
+/* Variants kept per URL for responses with a Vary header */
+#define MAX_VARIANTS 8
+
+/* Bodies too large for one cache entry are cached in chunks of this size */
+#define CHUNK_SIZE (64 * 1024)
+
+/* Requests for this path, rather than for a URL, get the metrics */
+#define METRICS_PATH "/metrics"
+/* Room for the metrics page */
+#define METRICS_PAGE (64 * 1024)
+
+/* iovec entries assemble_request() fills in for req: the request line,
+ * four per header and the blank line */
+#define REQUEST_IOV(req) (5 + 4 * (req)->num_headers + 1)
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
@@ -36,502 +76,2452 @@ typedef struct
     char path[MAXLINE];
     char version[20];
     int num_headers;
-    header_t headers[MAX_HEADERS];
+    int max_headers;                 /* room in headers, from the config */
+    header_t *headers;
+    char if_none_match[MAXLINE];     /* client's conditionals, answered by */
+    char if_modified_since[MAXLINE]; /* the proxy rather than forwarded */
+    char range[MAXLINE];             /* Range and If-Range, likewise; */
+    char if_range[MAXLINE];          /* forwarded only by forward_range() */
+    CacheKey key;                    /* canonical form of url */
+    int gzip;                        /* Accept-Encoding admits gzip */
+    Trace trace;                     /* when it reached each stage */
 } Request;
 
+/* A response copied out of the cache */
+typedef struct
+{
+    char *value; /* status line, headers and body; NULL if none */
+    ssize_t size;
+    CacheMeta meta;
+    CacheKey key; /* where it is cached: the URL's key, or one of its variants' */
+    int gzipped;  /* value still holds the gzipped body of a CACHE_COMPRESSED entry */
+} CachedResponse;
+
+/* An upgrade in progress: a newer proxy connected on the handoff socket */
+typedef struct
+{
+    int fd;          /* the newer proxy's connection, -1 if there is none */
+    int sent;        /* descriptors sent, waiting for HANDOFF_READY */
+    time_t deadline; /* when to give up on the newer proxy */
+} Upgrade;
+
+/* A stale-while-revalidate refresh waiting for a refresh worker */
+typedef struct RefreshJob RefreshJob;
+struct RefreshJob
+{
+    Request req;
+    CachedResponse stale;
+    RefreshJob *next;
+};
+
 void *handle_client(void *vargp);
-void initialize_struct(Request *req);
-void parse_request(char request[MAXLINE], Request *req);
-void parse_absolute(Request *req);
-void parse_relative(Request *req);
+int initialize_struct(Request *req);
+int parse_request(char request[MAXLINE], Request *req);
+int copy_token(char *dst, size_t size, const char *token);
+int parse_absolute(Request *req);
+int parse_relative(Request *req);
 void parse_header(char header[MAXLINE], Request *req);
+void make_key(Request *req);
+const char *request_header(Request *req, const char *name);
 void add_headers(Request *req);
-void assemble_request(Request *req, char *request);
-int get_from_cache(Request *req, int clientfd);
-void get_from_server(Request *req, char request[MAXLINE], int clientfd, rio_t rio_to_client);
+int assemble_request(Request *req, struct iovec *iov);
+void set_span(struct iovec *iov, const char *s);
+int send_request(Request *req, int serverfd);
+int get_from_cache(Request *req, int clientfd, CachedResponse *stale);
+void get_from_server(Request *req, int clientfd, rio_t rio_to_client, CachedResponse *stale);
+void send_cached(Request *req, int clientfd, CachedResponse *cached, time_t now);
+int send_range(Request *req, int clientfd, CachedResponse *cached, long age);
+size_t partial_headers(CachedResponse *cached, int multipart, char **out);
+size_t byteranges(CachedResponse *cached, HttpRange *ranges, int n, size_t length,
+                  const char *boundary, char **out);
+void forward_range(Request *req, int clientfd);
+uint64_t variant_key(Request *req, const char *vary, CacheKey *key);
+void store_response(Request *req, char *response, size_t size, CacheMeta *meta, CacheKey *stored_as);
+int get_encoded(Request *req, int clientfd);
+int encode_response(CachedResponse *cached, CachedResponse *encoded);
+int send_encoded(Request *req, int clientfd, CachedResponse *cached, time_t now, int store);
+size_t pack_response(char *response, size_t size, CacheMeta *meta, char **packed);
+int expand_response(CachedResponse *cached);
+int send_chunks(Request *req, int clientfd, CachedResponse *cached, size_t offset, size_t count);
+ssize_t fetch_chunk(Request *req, CachedResponse *cached, uint32_t index, char **data);
+void store_chunk(const CacheKey *object, uint32_t index, char *data, size_t size, CacheMeta *meta);
+uint64_t new_object_id(void);
+int send_range_request(Request *req, const char *range, const char *if_range, int serverfd);
+void add_conditional_headers(Request *req, CacheMeta *meta);
+int serve_stale_on_error(Request *req, int clientfd, CachedResponse *stale);
+void schedule_refresh(Request *req, CachedResponse *stale);
+void *refresh_worker(void *vargp);
+void start_refresh_workers(void);
+int connect_origin(Request *req);
+int origin_timeout(int serverfd, int timeout, time_t deadline);
+void origin_error(Request *req, int clientfd, CachedResponse *stale, int timed_out);
+int relay(int clientfd, void *buf, size_t n);
+void serve_metrics(int clientfd);
+void client_error(int fd, char *errnum, char *shortmsg, char *longmsg);
 void close_wrapper(int fd);
 void print_full(char *string);
 void print_struct(Request *req);
+void peer_name(int fd, char *buf, size_t len);
+int take_over_listener(char *handoff_path, int *upgradefd, int *cachefd);
+int hand_over_listener(int handoffd, struct pollfd *handoff, Upgrade *up, int *fds, int nfds);
+void serve(int listenfd, int handoffd, int cachefd);
+void supervise(int listenfd, int handoffd, int cachefd, int workers);
+pid_t start_worker(int listenfd);
+void handle_sigquit(int sig);
+void handle_sighup(int sig);
+int read_config(Config *cfg);
+void reload_config(int owner);
+void start_trim(void);
+void *trim_worker(void *vargp);
+void connection_start(void);
+void connection_done(void);
+void drain_connections(void);
 
-typedef struct CachedItem CachedItem;
+ssize_t get_from_cache_helper(CacheKey *key, void **value, CacheMeta *meta);
 
-struct CachedItem
-{
-    char *url;
-    char *item;
-    int size;
-    CachedItem *prev;
-    CachedItem *next;
-};
+CacheList *cache;
 
-/**
- * @brief Ordered by most recent
- *
- */
-typedef struct
+/* How URLs are normalized into cache keys (-q, -i) */
+static KeyOptions key_options;
+
+/* Settings in effect, read from config_path and the overrides; reread on SIGHUP */
+static Config config;
+static const char *config_path = NULL;
+static struct
 {
-    CachedItem *head;
-    CachedItem *tail;
-    int size;
-} CacheList;
-
-extern void cache_init(CacheList *list);
-extern void cache_URL(char *URL, void *item, size_t size, CacheList *list);
-extern void evict(CacheList *list);
-extern CachedItem *find(char *URL, CacheList *list);
-extern void move_to_front(char *URL, CacheList *list);
-extern void print_URLs(CacheList *list);
-extern void cache_destruct(CacheList *list);
-void cache_insert(char *URL, void *item, size_t size, CacheList *list);
-char *get_from_cache_helper(char *key);
+    const char *name;
+    const char *value;
+} overrides[MAX_OVERRIDES];
+static int noverrides = 0;
+static volatile sig_atomic_t reload_requested = 0;
 
-CacheList *cache;
+/* Set while a trim thread is working off an over-budget cache */
+static int trimming = 0;
+static pthread_mutex_t trim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* In-flight connections, tracked so a replaced proxy can drain them */
+static int active_connections = 0;
+static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_drained = PTHREAD_COND_INITIALIZER;
+
+/* Set by SIGQUIT: stop accepting and drain, as after a handoff */
+static volatile sig_atomic_t stop_accepting = 0;
+
+/* Refresh queue, served by REFRESH_WORKERS threads started on first use */
+static RefreshJob *refresh_head = NULL, *refresh_tail = NULL;
+static int refresh_queued = 0;
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_ready = PTHREAD_COND_INITIALIZER;
+static pthread_once_t refresh_once = PTHREAD_ONCE_INIT;
+
+/* Numbers multipart/byteranges boundaries, so no two responses share one */
+static unsigned long boundary_counter = 0;
 
 int main(int argc, char **argv)
 {
-    cache = (CacheList *)malloc(sizeof(CacheList));
-    cache_init(cache);
-    int listenfd, *connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr; /* Enough space for any address */
-    pthread_t tid;
+    int listenfd = -1, handoffd = -1, upgradefd = -1, cachefd = -1, opt;
+    char *handoff_path = NULL;
+    struct sigaction action;
 
-    if (argc != 2)
+    while ((opt = getopt(argc, argv, "H:c:m:M:o:s:w:p:l:zqi:")) != -1)
     {
-        printf("usage: %s <port>\n", argv[0]);
-        exit(0);
+        switch (opt)
+        {
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'c':
+            config_path = optarg;
+            break;
+        case 'm':
+        case 'M':
+        case 'o':
+        case 's':
+        case 'w':
+        case 'p':
+        case 'l':
+            if (noverrides == MAX_OVERRIDES)
+                optind = argc;
+            else
+            {
+                overrides[noverrides].name = opt == 'm'   ? "cache_size"
+                                             : opt == 'M' ? "cache_limit"
+                                             : opt == 'o' ? "max_object_size"
+                                             : opt == 's' ? "shards"
+                                             : opt == 'w' ? "workers"
+                                             : opt == 'l' ? "log_level"
+                                                          : "policy";
+                overrides[noverrides++].value = optarg;
+            }
+            break;
+        case 'z':
+            if (noverrides == MAX_OVERRIDES)
+                optind = argc;
+            else
+            {
+                overrides[noverrides].name = "compress";
+                overrides[noverrides++].value = "1";
+            }
+            break;
+        case 'q':
+            key_options.sort_query = 1;
+            break;
+        case 'i':
+            if (key_options.nignored == KEY_MAX_IGNORED)
+                optind = argc;
+            else
+                key_options.ignored[key_options.nignored++] = optarg;
+            break;
+        default:
+            optind = argc; /* force the usage message */
+        }
     }
-
-    listenfd = Open_listenfd(argv[1]);
-    while (1)
+    if (optind != argc - 1)
     {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfd = Malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, handle_client, connfd);
+        printf("usage: %s [-H <handoff socket>] [-c <config file>] [-m <cache size>] "
+               "[-M <cache limit>] [-o <max object size>] [-s <shards>] [-w <workers>] "
+               "[-p lru|fifo] [-l <log level>] [-z] [-q] [-i <query param>]... <port>\n",
+               argv[0]);
+        exit(0);
     }
-    printf("%s", user_agent);
-    cache_destruct(cache);
-    return 0;
-}
+    if (read_config(&config) < 0)
+        exit(1);
+    log_level = config.log_level;
+    log_start(STDOUT_FILENO);
+    if (trace_open(config.trace_file) < 0)
+        fprintf(stderr, "trace file %s: %s\n", config.trace_file, strerror(errno));
+    /** before any fork: the workers share the counters */
+    if (metrics_init() < 0)
+        fprintf(stderr, "metrics: %s, not collected\n", strerror(errno));
 
-void *handle_client(void *vargp)
-{
-    int clientfd = *((int *)vargp);
-    Pthread_detach(pthread_self());
-    Free(vargp);
-    char request[MAXLINE];
-    rio_t rio_to_client;
-    rio_readinitb(&rio_to_client, clientfd);
+    /** an older proxy may already own the port: take its socket over */
+    if (handoff_path != NULL)
+        listenfd = take_over_listener(handoff_path, &upgradefd, &cachefd);
+    if (listenfd < 0)
+        listenfd = Open_listenfd(argv[optind]);
 
-    // read the request
-    rio_readlineb(&rio_to_client, request, MAXLINE);
-
-    // parse the request
-    Request req;
-    initialize_struct(&req);
-    parse_request(request, &req);
-    if (strcmp(req.method, "GET") != 0) // Only support get
+    /** keep the old proxy's cache if it was laid out the way we expect */
+    if (cachefd >= 0 && (cache = cache_attach(cachefd, config.cache_limit, config.shards)) == NULL)
     {
-        printf("%s", user_agent);
-        printf("%s", request);
-        printf("%s", "HTTP/1.0 501 Not Implemented\r\n");
-        printf("%s", "Content-type: text/html\r\n\r\n");
-        printf("%s", "<html><head><title>Not Implemented</title></head>");
-        printf("%s", "<body><p>HTTP request method not supported.</p></body></html>");
-        close_wrapper(clientfd);
-        return NULL;
+        close(cachefd);
+        cachefd = -1;
     }
-    add_headers(&req);
-    print_struct(&req); // after
+    if (cache == NULL && (cache = cache_create(config.cache_limit, config.shards, &cachefd)) == NULL)
+        unix_error("cache_create error");
+    cache_configure(cache, config.cache_size, config.max_object_size, config.policy);
+    /** an inherited cache may be over a smaller budget */
+    start_trim();
 
-    // check if the request is in the cache
-    int in_cache = get_from_cache(&req, clientfd);
-    if (in_cache == 1)
-    {
-        printf("In cache\n");
-    }
-    else
-    {
-        printf("Not in cache\n");
-        get_from_server(&req, request, clientfd, rio_to_client);
-    }
-    print_URLs(cache);
-    close_wrapper(clientfd);
-    return NULL;
-}
+    /** no SA_RESTART: poll() and accept() must return so the flag is seen */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigquit;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGQUIT, &action, NULL);
+    action.sa_handler = handle_sighup;
+    sigaction(SIGHUP, &action, NULL);
+    /** a peer that hangs up fails the write to it, not the whole proxy */
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
 
-void initialize_struct(Request *req)
-{
-    strcpy(req->method, "");
-    strcpy(req->url, "");
-    strcpy(req->hostname, "");
-    strcpy(req->port, "80");
-    strcpy(req->path, "");
-    strcpy(req->version, "");
-    req->num_headers = 0;
-}
-void parse_request(char request[MAXLINE], Request *req)
-{
-    char *token;
-    char *saveptr;
-    char *line = strdup(request);
-    token = strtok_r(line, " ", &saveptr);
-    strcpy(req->method, token);
-    if (strcmp(req->method, "GET") != 0) // only support GET
+    if (handoff_path != NULL)
     {
-        free(line);
-        return;
+        if ((handoffd = handoff_listen(handoff_path)) < 0)
+            fprintf(stderr, "handoff socket %s: %s\n", handoff_path, strerror(errno));
     }
-    token = strtok_r(NULL, " ", &saveptr);
-    strcpy(req->url, token);
-
-    token = strtok_r(NULL, "\r\n", &saveptr);
-    strcpy(req->version, token);
-    if (strncmp(req->url, "http://", 7) == 0)
+    if (upgradefd >= 0)
     {
-        parse_absolute(req);
+        /** tell the old proxy we are accepting; it starts draining now */
+        handoff_send_byte(upgradefd, HANDOFF_READY);
+        close(upgradefd);
     }
-    else
+    /** only now take the old proxy's handoff socket name: had the upgrade
+     *  failed, it would still need it for the next attempt */
+    if (handoffd >= 0 && handoff_publish(handoff_path) < 0)
     {
-        parse_relative(req);
+        fprintf(stderr, "handoff socket %s: %s\n", handoff_path, strerror(errno));
+        close(handoffd);
+        handoffd = -1;
     }
 
-    token = strtok_r(NULL, "\r\n", &saveptr);
-    while (token != NULL)
+    if (config.workers > 0)
+        supervise(listenfd, handoffd, cachefd, config.workers);
+    else
     {
-        parse_header(token, req);
-        token = strtok_r(NULL, "\r\n", &saveptr);
+        serve(listenfd, handoffd, cachefd);
+        /** replaced by a newer proxy: let in-flight requests finish */
+        drain_connections();
     }
-    free(line);
+    log_flush();
+    cache_destruct(cache);
+    return 0;
 }
-void parse_absolute(Request *req)
+
+void handle_sigquit(int sig)
 {
-    char *token;
-    char *saveptr;
-    char *line = strdup(req->url + 7);
-    if (strchr(line, ':') != NULL) // has port number
-    {
-        token = strtok_r(line, ":", &saveptr);
-        strcpy(req->hostname, token);
-        token = strtok_r(NULL, "/", &saveptr);
-        strcpy(req->port, token);
-        strcpy(req->path, saveptr);
-    }
-    else // doesn't have port number
-    {
-        token = strtok_r(line, "/", &saveptr);
-        strcpy(req->hostname, token);
-        strcpy(req->path, saveptr);
-    }
-    free(line);
+    stop_accepting = 1;
 }
-void parse_relative(Request *req)
+
+void handle_sighup(int sig)
 {
-    char *token;
-    char *saveptr;
-    char *line = strdup(req->url);
-    token = strtok_r(line, "/", &saveptr);
-    strcpy(req->path, token);
-    free(line);
+    reload_requested = 1;
 }
-void parse_header(char header[MAXLINE], Request *req)
+
+/**
+ * @brief Read the settings: the defaults, then the config file (-c), then
+ *        the command-line overrides
+ *
+ * @return 0 on success, -1 (reported on stderr) if they are invalid
+ */
+int read_config(Config *cfg)
 {
-    char *token;
-    char *saveptr;
-    char *line = strdup(header);
-    token = strtok_r(line, ": ", &saveptr);
-    if (strcmp(token, "Host") == 0 || strcmp(token, "User-Agent") == 0 || strcmp(token, "Connection") == 0 || strcmp(token, "Proxy-Connection") == 0)
+    config_defaults(cfg);
+    if (config_path != NULL && config_load(config_path, cfg) < 0)
+        return -1;
+    for (int i = 0; i < noverrides; i++)
     {
-        free(line);
-        return;
+        if (config_set(cfg, overrides[i].name, overrides[i].value) < 0)
+        {
+            fprintf(stderr, "config: bad %s: %s\n", overrides[i].name, overrides[i].value);
+            return -1;
+        }
     }
-    strcpy(req->headers[req->num_headers].name, token);
-    strcpy(req->headers[req->num_headers].value, saveptr);
-    req->num_headers++;
-    free(line);
+    return config_check(cfg);
 }
 
-/** add headers to the request */
-void add_headers(Request *req)
+/**
+ * @brief Reread the settings after a SIGHUP
+ *
+ * The shards and the cache_limit size the shared mapping and only change
+ * with a restart; everything else takes effect for new requests. If the
+ * new settings are invalid the old ones stay.
+ *
+ * @param owner Nonzero in the process that manages the cache (the only
+ *        process, or the prefork master): it applies the new budget and
+ *        trims down to it
+ */
+void reload_config(int owner)
 {
-    int host_header_exists = 0;
-    for (int i = 0; i < req->num_headers; i++)
+    Config next;
+
+    reload_requested = 0;
+    if (read_config(&next) < 0)
     {
-        if (strcmp(req->headers[i].name, "Host") == 0)
-        {
-            host_header_exists = 1;
-            break;
-        }
+        fprintf(stderr, "config: reload failed, keeping the current settings\n");
+        return;
     }
-    if (!host_header_exists)
+    if (next.shards != config.shards || next.cache_limit != config.cache_limit)
     {
-        strcpy(req->headers[req->num_headers].name, "Host");
-        if (strlen(req->port) == 0)
-            sprintf(req->headers[req->num_headers].value, "%s", req->hostname);
-        else
-            sprintf(req->headers[req->num_headers].value, "%s:%s", req->hostname, req->port);
-        req->num_headers++;
+        fprintf(stderr, "config: shards and cache_limit need a restart, keeping %d and %zu\n",
+                config.shards, config.cache_limit);
+        next.shards = config.shards;
+        next.cache_limit = config.cache_limit;
+        if (next.cache_size > next.cache_limit)
+            next.cache_size = next.cache_limit;
+    }
+    if (strcmp(next.trace_file, config.trace_file) != 0 && trace_open(next.trace_file) < 0)
+    {
+        fprintf(stderr, "trace file %s: %s, keeping %s\n", next.trace_file, strerror(errno),
+                config.trace_file);
+        strcpy(next.trace_file, config.trace_file);
+    }
+    config = next;
+    log_level = config.log_level;
+    if (owner)
+    {
+        cache_configure(cache, config.cache_size, config.max_object_size, config.policy);
+        start_trim();
     }
-    strcpy(req->headers[req->num_headers].name, "User-Agent");
-    strcpy(req->headers[req->num_headers].value, user_agent);
-    req->num_headers++;
-    strcpy(req->headers[req->num_headers].name, "Connection");
-    strcpy(req->headers[req->num_headers].value, "close");
-    req->num_headers++;
-    strcpy(req->headers[req->num_headers].name, "Proxy-Connection");
-    strcpy(req->headers[req->num_headers].value, "close");
-    req->num_headers++;
 }
 
-void assemble_request(Request *req, char *request)
+/**
+ * @brief Evict down to the budget in the background, if the cache is over it
+ */
+void start_trim(void)
 {
-    strcpy(request, req->method);
-    strcat(request, " /");
-    strcat(request, req->path);
-    strcat(request, " ");
-    strcat(request, "HTTP/1.0\r\n");
-    int i;
-    for (i = 0; i < req->num_headers; i++)
+    pthread_t tid;
+
+    pthread_mutex_lock(&trim_mutex);
+    if (!trimming)
     {
-        strcat(request, req->headers[i].name);
-        strcat(request, ": ");
-        strcat(request, req->headers[i].value);
-        strcat(request, "\r\n");
+        trimming = 1;
+        Pthread_create(&tid, NULL, trim_worker, NULL);
     }
-    strcat(request, "\r\n");
+    pthread_mutex_unlock(&trim_mutex);
 }
 
-int get_from_cache(Request *req, int clientfd)
+void *trim_worker(void *vargp)
 {
-    char *key = req->url;
-    char *value = get_from_cache_helper(key);
-    if (value == NULL)
-        return 0;
-    else
+    Pthread_detach(pthread_self());
+    while (1)
     {
-        printf("Found in cache\n");
-        /** move the last used cache to the front to maintain LRU alignment */
-        move_to_front(key, cache);
-        Rio_writen(clientfd, value, strlen(value));
-        return 1;
+        /** held across the step so a start_trim() racing with the last one
+         *  either sees trimming set or starts a new thread */
+        pthread_mutex_lock(&trim_mutex);
+        if (cache_trim(cache, TRIM_BATCH) == 0)
+        {
+            trimming = 0;
+            pthread_mutex_unlock(&trim_mutex);
+            return NULL;
+        }
+        pthread_mutex_unlock(&trim_mutex);
+        usleep(TRIM_PAUSE_US);
     }
 }
 
 /**
- * @brief: get the value of the key(url) from cache using find() function
- * @param key: the key(url) to be searched
- * @return: the value of the key if found, NULL otherwise
+ * @brief Accept clients until told to stop or the listening socket is
+ *        handed to a newer proxy
+ *
+ * @param listenfd The listening socket
+ * @param handoffd The handoff socket, or -1 if this process doesn't do handoffs
+ * @param cachefd The shared cache segment, handed over with the socket
  */
-char *get_from_cache_helper(char *key)
+void serve(int listenfd, int handoffd, int cachefd)
 {
-    CachedItem *item = find(key, cache);
-    if (item == NULL)
-        return NULL;
-    else
-        return item->item;
+    int *connfd, fd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr; /* Enough space for any address */
+    pthread_t tid;
+    struct pollfd fds[2];
+    int nfds = handoffd < 0 ? 1 : 2;
+    int handed[2] = {listenfd, cachefd};
+    Upgrade up = {-1, 0, 0};
+
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = handoffd;
+    fds[1].events = POLLIN;
+    while (!stop_accepting)
+    {
+        /** prefork workers are passed no cachefd: the master owns the cache */
+        if (reload_requested)
+            reload_config(cachefd >= 0);
+        /** a signal may land on a client thread: wake up now and then anyway */
+        if (poll(fds, nfds, 1000) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        if (nfds == 2 && hand_over_listener(handoffd, &fds[1], &up, handed, 2))
+            break;
+        if (fds[0].revents & POLLIN)
+        {
+            clientlen = sizeof(struct sockaddr_storage);
+            /** another worker may have won the race for this connection */
+            if ((fd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0)
+                continue;
+            /** out of memory or threads: turn this connection away, keep serving */
+            if ((connfd = malloc(sizeof(int))) == NULL)
+            {
+                close(fd);
+                continue;
+            }
+            *connfd = fd;
+            connection_start();
+            if (pthread_create(&tid, NULL, handle_client, connfd) != 0)
+            {
+                close(fd);
+                free(connfd);
+                connection_done();
+            }
+        }
+    }
+    Close(listenfd);
+    if (handoffd >= 0)
+        Close(handoffd);
 }
 
 /**
- * @brief Get the from server object
+ * @brief Prefork mode: run workers sharing the listening socket and the
+ *        cache, replace any that die, and hand both over on upgrade
  *
- * @param req The request object
- * @param request The request string
- * @param clientfd The client file descriptor
- * @param rio_to_client The rio object to the client
+ * @param workers The number of worker processes to start with; a reload
+ *        may change it
  */
-void get_from_server(Request *req, char request[MAXLINE], int clientfd, rio_t rio_to_client)
+void supervise(int listenfd, int handoffd, int cachefd, int workers)
 {
-    size_t n;
-    int serverfd;
-    char buf[MAXLINE];
-    rio_t rio_to_server;
+    pid_t pids[CONFIG_MAX_WORKERS], pid;
+    struct pollfd fd;
+    int status;
+    int handed[2] = {listenfd, cachefd};
+    Upgrade up = {-1, 0, 0};
 
-    char *hostname = req->hostname;
-    char *port = req->port;
-    serverfd = Open_clientfd(hostname, port);
+    for (int i = 0; i < workers; i++)
+        pids[i] = start_worker(listenfd);
 
-    Rio_readinitb(&rio_to_server, serverfd);
-    assemble_request(req, request);
-    printf("%s", request);
-    Rio_writen(serverfd, request, strlen(request));
-    void *full_response = malloc(MAX_OBJECT_SIZE);
-    int full_response_size = 0;
-    while ((n = Rio_readlineb(&rio_to_server, buf, MAXLINE)) != 0)
-    {
-        if (full_response_size + n <= MAX_OBJECT_SIZE)
+    fd.fd = handoffd; /* poll() skips it if negative */
+    fd.events = POLLIN;
+    while (!stop_accepting)
+    {
+        if (poll(&fd, 1, 1000) < 0)
+            fd.revents = 0;
+        if (handoffd >= 0 && hand_over_listener(handoffd, &fd, &up, handed, 2))
+            break;
+        if (reload_requested)
         {
-            /** copy the response buffer to the full_response */
-            memcpy(full_response + full_response_size, buf, n);
-            full_response_size += n;
+            reload_config(1);
+            for (int i = 0; i < workers; i++)
+                kill(pids[i], SIGHUP);
+            /** grow or shrink the pool; retired workers drain and exit */
+            int target = config.workers > 0 ? config.workers : 1;
+            while (workers < target)
+                pids[workers++] = start_worker(listenfd);
+            while (workers > target)
+                kill(pids[--workers], SIGQUIT);
+        }
+        /** a worker died (crashed, most likely): keep the pool at full size */
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (int i = 0; i < workers; i++)
+            {
+                if (pids[i] == pid)
+                {
+                    fprintf(stderr, "worker %d exited with status %d, restarting\n", (int)pid, status);
+                    pids[i] = start_worker(listenfd);
+                }
+            }
         }
-
-        Rio_writen(clientfd, buf, n);
-    }
-    if (full_response_size <= MAX_OBJECT_SIZE)
-    {
-        /** add to cache */
-        cache_URL(req->url, full_response, strlen(full_response), cache);
-    }
-    free(full_response);
-    Close(serverfd);
-}
-void close_wrapper(int fd)
-{
-    Close(fd);
-}
-void print_full(char *string)
-{
-    printf("%s\n", string);
-}
-void print_struct(Request *req)
-{
-    printf("Method: %s\n", req->method == NULL ? "NULL" : req->method);
-    printf("URL: %s\n", req->url == NULL ? "NULL" : req->url);
-    printf("Hostname: %s\n", req->hostname == NULL ? "NULL" : req->hostname);
-    printf("Port: %s\n", req->port == NULL ? "NULL" : req->port);
-    printf("Path: %s\n", req->path == NULL ? "NULL" : req->path);
-    printf("Version: %s\n", req->version == NULL ? "NULL" : req->version);
-    for (int i = 0; i < req->num_headers; i++)
-    {
-        printf("Header %d: %s: %s\n", i, req->headers[i].name, req->headers[i].value);
     }
-    printf("\n");
-}
+    Close(listenfd);
+    if (handoffd >= 0)
+        Close(handoffd);
 
-extern void cache_init(CacheList *list)
-{
-    list->head = NULL;
-    list->tail = NULL;
-    list->size = 0;
+    /** workers stop accepting and drain on SIGQUIT */
+    for (int i = 0; i < workers; i++)
+        kill(pids[i], SIGQUIT);
+    for (int i = 0; i < workers; i++)
+        waitpid(pids[i], NULL, 0);
 }
 
-/** @brief: add a new item to the cache
- *  @param key: the key(url) to be added
- *  @param value: the value of the key
- *  @param size: the size of the value
- *  @param list: the cache list
+/**
+ * @brief Fork a worker that serves clients from the shared listening socket
+ *
+ * @return The worker's pid
  */
-extern void cache_URL(char *URL, void *item, size_t size, CacheList *list)
+pid_t start_worker(int listenfd)
 {
-    while (list->size + size > MAX_CACHE_SIZE)
+    pid_t pid;
+
+    fflush(stdout);
+    log_flush(); /* or the child would write the lines pending here again */
+    if ((pid = Fork()) == 0)
     {
-        evict(list);
+        prctl(PR_SET_PDEATHSIG, SIGTERM); /* don't outlive the master */
+        log_start(STDOUT_FILENO);
+        serve(listenfd, -1, -1);
+        drain_connections();
+        exit(0);
     }
-    cache_insert(URL, item, size, list);
+    return pid;
 }
 
 /**
- * @brief Evict the last item in the cache
+ * @brief Ask the proxy listening on handoff_path for its listening socket
  *
- * @param list
+ * @param handoff_path The old proxy's handoff socket
+ * @param upgradefd Set to the open handoff connection, used to send
+ *        HANDOFF_READY once this process is ready to accept
+ * @param cachefd Set to the old proxy's cache segment, if it sent one
+ * @return The inherited listening socket, or -1 if there is no old proxy
  */
-extern void evict(CacheList *list)
+int take_over_listener(char *handoff_path, int *upgradefd, int *cachefd)
 {
-    if (list->tail == NULL)
-        return;
-    CachedItem *item = list->tail;
-    list->tail = item->prev;
-    if (list->tail == NULL)
-        list->head = NULL;
-    else
-        list->tail->next = NULL;
-    list->size -= item->size;
-    free(item->url);
-    free(item->item);
-    free(item);
-}
-
-/** @brief: insert a new item to the cache
- *  @param key: the key(url) to be added
- *  @param value: the value of the key
- *  @param size: the size of the value
- *  @param list: the cache list
- */
-void cache_insert(char *URL, void *item, size_t size, CacheList *list)
-{
-    CachedItem *node = malloc(sizeof(CachedItem));
-    node->url = malloc((strlen(URL) + 1) * sizeof(char));
-    strcpy(node->url, URL);
-    node->item = malloc(size);
-    memcpy(node->item, item, size);
-    node->size = size;
-    node->next = NULL;
-    node->prev = NULL;
-    if (list->head == NULL)
-    {
-        list->head = node;
-        list->tail = node;
-    }
-    else
+    int fd, n, fds[HANDOFF_MAX_FDS];
+
+    if ((fd = handoff_connect(handoff_path)) < 0)
+        return -1;
+    if (handoff_send_byte(fd, HANDOFF_REQUEST) < 0 ||
+        (n = handoff_recv_fds(fd, fds, HANDOFF_MAX_FDS)) < 1)
     {
-        list->tail->next = node;
-        node->prev = list->tail;
-        list->tail = node;
+        fprintf(stderr, "handoff from %s failed, opening a new socket\n", handoff_path);
+        close(fd);
+        return -1;
     }
-    list->size += size;
+    for (int i = 2; i < n; i++)
+        close(fds[i]); /* from a newer protocol than ours */
+    *cachefd = n >= 2 ? fds[1] : -1;
+    *upgradefd = fd;
+    return fds[0];
 }
 
-/** @brief: find a key in the cache
- *  @param key: the key(url) to be searched
- *  @param list: the cache list
- *  @return: the value of the key if found, NULL otherwise
+/**
+ * @brief Give the listening socket (and cache) to a newer proxy, one step
+ *        per call as poll() finds its connection ready
+ *
+ * Nothing here blocks, so clients keep being accepted while the newer
+ * proxy starts up. An upgrade that fails or takes longer than
+ * HANDOFF_TIMEOUT is dropped, and the handoff socket watched again.
+ *
+ * @param handoff The poll entry of the handoff socket; during an upgrade
+ *        it watches the newer proxy's connection instead
+ * @param up The upgrade in progress, if any
+ * @param fds The descriptors to pass; the listening socket comes first
+ * @return 1 if the new proxy took over and this one should drain, 0 if
+ *         this proxy keeps serving
  */
-extern CachedItem *find(char *URL, CacheList *list)
+int hand_over_listener(int handoffd, struct pollfd *handoff, Upgrade *up, int *fds, int nfds)
 {
-    CachedItem *item = list->head;
-    while (item != NULL)
+    char c;
+
+    if (up->fd < 0)
     {
-        if (strcmp(item->url, URL) == 0)
+        if ((handoff->revents & POLLIN) && (up->fd = accept(handoffd, NULL, NULL)) >= 0)
         {
-            return item;
+            up->sent = 0;
+            up->deadline = time(NULL) + HANDOFF_TIMEOUT;
+            handoff->fd = up->fd;
         }
-        item = item->next;
-    }
-    return NULL;
-}
-
-extern void move_to_front(char *URL, CacheList *list)
-{
-    CachedItem *item = find(URL, list);
-    if (item == NULL)
-        return;
-    if (item == list->head)
-        return;
-    if (item == list->tail)
-    {
-        list->tail = item->prev;
-        list->tail->next = NULL;
+        return 0;
     }
-    else
+    if (handoff->revents & (POLLIN | POLLHUP | POLLERR))
     {
-        item->prev->next = item->next;
-        item->next->prev = item->prev;
+        /** a request, answered with the descriptors, then the go-ahead */
+        if (handoff_recv_byte(up->fd, &c) == 0 && c == (up->sent ? HANDOFF_READY : HANDOFF_REQUEST))
+        {
+            if (up->sent)
+            {
+                close(up->fd);
+                return 1;
+            }
+            if (handoff_send_fds(up->fd, fds, nfds) == 0)
+            {
+                up->sent = 1;
+                return 0;
+            }
+        }
     }
-    item->next = list->head;
-    list->head->prev = item;
-    list->head = item;
-    item->prev = NULL;
+    else if (time(NULL) < up->deadline)
+        return 0;
+    close(up->fd);
+    up->fd = -1;
+    handoff->fd = handoffd;
+    return 0;
 }
-extern void print_URLs(CacheList *list)
+
+void connection_start(void)
 {
-    printf("-----------\n");
-    CachedItem *item = list->head;
-    while (item != NULL)
-    {
-        printf("%s\n", item->url);
-        item = item->next;
-    }
-    printf("-----------\n");
+    pthread_mutex_lock(&connections_mutex);
+    active_connections++;
+    pthread_mutex_unlock(&connections_mutex);
+    metrics_add(METRIC_CONNECTIONS, 1);
 }
-extern void cache_destruct(CacheList *list)
+
+void connection_done(void)
 {
-    CachedItem *item = list->head;
-    while (item != NULL)
-    {
-        CachedItem *next = item->next;
-        free(item->url);
-        free(item);
-        item = next;
+    metrics_add(METRIC_CONNECTIONS, -1);
+    pthread_mutex_lock(&connections_mutex);
+    if (--active_connections == 0)
+        pthread_cond_broadcast(&connections_drained);
+    pthread_mutex_unlock(&connections_mutex);
+}
+
+/**
+ * @brief Wait for in-flight connections to finish, at most DRAIN_TIMEOUT seconds
+ */
+void drain_connections(void)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT;
+    pthread_mutex_lock(&connections_mutex);
+    while (active_connections > 0)
+    {
+        if (pthread_cond_timedwait(&connections_drained, &connections_mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&connections_mutex);
+}
+
+void *handle_client(void *vargp)
+{
+    int clientfd = *((int *)vargp);
+    Request req;
+    trace_start(&req.trace);
+    PROBE1(request__start, clientfd);
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    char request[MAXLINE];
+    rio_t rio_to_client;
+    rio_readinitb(&rio_to_client, clientfd);
+    /** a client that stalls gives up its thread, not the process */
+    io_set_timeout(clientfd, SO_RCVTIMEO, config.client_timeout);
+    io_set_timeout(clientfd, SO_SNDTIMEO, config.client_timeout);
+
+    // read the request
+    if (rio_readlineb(&rio_to_client, request, MAXLINE) <= 0)
+    {
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+
+    // parse the request
+    if (initialize_struct(&req) < 0)
+    {
+        client_error(clientfd, "503", "Service Unavailable", "Out of memory");
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+    if (parse_request(request, &req) < 0)
+    {
+        client_error(clientfd, "400", "Bad Request", "Malformed request line");
+        free(req.headers);
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+    if (strcmp(req.method, "GET") != 0) // Only support get
+    {
+        client_error(clientfd, "501", "Not Implemented", "HTTP request method not supported");
+        free(req.headers);
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+
+    // read the request headers
+    char line[MAXLINE];
+    while (rio_readlineb(&rio_to_client, line, MAXLINE) > 0)
+    {
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+            break;
+        line[strcspn(line, "\r\n")] = '\0';
+        parse_header(line, &req);
+    }
+    trace_mark(&req.trace, TRACE_PARSED);
+    if (strcmp(req.url, METRICS_PATH) == 0)
+    {
+        serve_metrics(clientfd);
+        free(req.headers);
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+    /** anything else relative has no origin to go to */
+    if (req.hostname[0] == '\0')
+    {
+        client_error(clientfd, "400", "Bad Request", "Request URL has no host");
+        free(req.headers);
+        close_wrapper(clientfd);
+        connection_done();
+        return NULL;
+    }
+    add_headers(&req);
+    make_key(&req);
+    req.gzip = http_accepts_gzip(request_header(&req, "Accept-Encoding"));
+    if (log_level >= LOG_LEVEL_DEBUG)
+        print_struct(&req); // after
+
+    // check if the request is in the cache
+    CachedResponse stale = {NULL, 0};
+    stale.key.len = 0;
+    int in_cache = get_from_cache(&req, clientfd, &stale);
+    if (in_cache != 1)
+        get_from_server(&req, clientfd, rio_to_client, &stale);
+    trace_mark(&req.trace, TRACE_DONE);
+    metrics_add(METRIC_REQUESTS, 1);
+    metrics_add(in_cache == 1 ? METRIC_HITS : METRIC_MISSES, 1);
+    metrics_observe(METRIC_REQUEST_TIME, req.trace.at[TRACE_DONE] - req.trace.at[TRACE_ACCEPT]);
+    PROBE3(request__done, req.url, in_cache == 1, req.trace.at[TRACE_DONE] - req.trace.at[TRACE_ACCEPT]);
+    if (log_level >= LOG_LEVEL_INFO)
+    {
+        char peer[NI_MAXHOST], stages[256];
+        peer_name(clientfd, peer, sizeof(peer));
+        trace_format(&req.trace, stages, sizeof(stages));
+        log_write(LOG_LEVEL_INFO, "access %s %s %s %s %s", peer, req.method, req.url,
+                  in_cache == 1 ? "hit" : "miss", stages);
+    }
+    if (trace_sampled(&req.trace, config.trace_sample))
+        trace_write(&req.trace, req.url);
+    free(stale.value);
+    free(req.headers);
+    if (log_level >= LOG_LEVEL_DEBUG)
+    {
+        /** dumps that bypass the log: stdout, flushed per request */
+        print_URLs(cache);
+        fflush(stdout);
+    }
+    close_wrapper(clientfd);
+    connection_done();
+    return NULL;
+}
+
+/**
+ * @brief Reset req for a new request
+ *
+ * @return 0 on success, -1 if the header table can't be allocated
+ */
+int initialize_struct(Request *req)
+{
+    strcpy(req->method, "");
+    strcpy(req->url, "");
+    strcpy(req->hostname, "");
+    strcpy(req->port, "80");
+    strcpy(req->path, "");
+    strcpy(req->version, "");
+    req->num_headers = 0;
+    req->max_headers = config.max_headers;
+    strcpy(req->if_none_match, "");
+    strcpy(req->if_modified_since, "");
+    strcpy(req->range, "");
+    strcpy(req->if_range, "");
+    req->gzip = 0;
+    req->headers = malloc(sizeof(header_t) * req->max_headers);
+    return req->headers == NULL ? -1 : 0;
+}
+/**
+ * @brief Copy a request line token into one of the Request's fields
+ *
+ * @return 0 on success, -1 if the token is missing or doesn't fit
+ */
+int copy_token(char *dst, size_t size, const char *token)
+{
+    if (token == NULL || strlen(token) >= size)
+        return -1;
+    strcpy(dst, token);
+    return 0;
+}
+
+/**
+ * @brief Parse the request line into req
+ *
+ * @return 0 on success, -1 if it is malformed (a missing part, or one
+ *         too long for req)
+ */
+int parse_request(char request[MAXLINE], Request *req)
+{
+    char *token;
+    char *saveptr;
+    char line[MAXLINE];
+
+    snprintf(line, sizeof(line), "%s", request);
+    token = strtok_r(line, " \r\n", &saveptr);
+    if (copy_token(req->method, sizeof(req->method), token) < 0)
+        return -1;
+    if (strcmp(req->method, "GET") != 0) // only support GET
+        return 0;
+    token = strtok_r(NULL, " ", &saveptr);
+    if (copy_token(req->url, sizeof(req->url), token) < 0)
+        return -1;
+
+    token = strtok_r(NULL, "\r\n", &saveptr);
+    if (copy_token(req->version, sizeof(req->version), token) < 0)
+        return -1;
+    if (strncasecmp(req->url, "http://", 7) == 0)
+    {
+        if (parse_absolute(req) < 0)
+            return -1;
+    }
+    else
+    {
+        if (parse_relative(req) < 0)
+            return -1;
+    }
+
+    token = strtok_r(NULL, "\r\n", &saveptr);
+    while (token != NULL)
+    {
+        parse_header(token, req);
+        token = strtok_r(NULL, "\r\n", &saveptr);
+    }
+    return 0;
+}
+/**
+ * @brief Split an absolute URL, http://host[:port][/path], into req
+ *
+ * @return 0 on success, -1 if the host or the port is empty or doesn't fit
+ */
+int parse_absolute(Request *req)
+{
+    const char *host = req->url + 7, *p;
+    size_t host_len = strcspn(host, ":/"), port_len;
+
+    if (host_len == 0 || host_len >= sizeof(req->hostname))
+        return -1;
+    memcpy(req->hostname, host, host_len);
+    req->hostname[host_len] = '\0';
+    p = host + host_len;
+    if (*p == ':') // has port number
+    {
+        port_len = strcspn(++p, "/");
+        if (port_len == 0 || port_len >= sizeof(req->port))
+            return -1;
+        memcpy(req->port, p, port_len);
+        req->port[port_len] = '\0';
+        p += port_len;
+    }
+    return copy_token(req->path, sizeof(req->path), *p == '/' ? p + 1 : p);
+}
+
+/**
+ * @brief Take the path of a relative URL, without its leading '/'
+ *
+ * @return 0 on success, -1 if it doesn't fit
+ */
+int parse_relative(Request *req)
+{
+    return copy_token(req->path, sizeof(req->path), req->url + strspn(req->url, "/"));
+}
+void parse_header(char header[MAXLINE], Request *req)
+{
+    char *token;
+    char *saveptr;
+    char *line = strdup(header);
+    token = strtok_r(line, ": ", &saveptr);
+    /** leave room for add_headers(), add_conditional_headers() and forward_range() */
+    if (token == NULL || req->num_headers >= req->max_headers - 8)
+    {
+        free(line);
+        return;
+    }
+    saveptr += strspn(saveptr, " \t");
+    if (strcasecmp(token, "Host") == 0 || strcasecmp(token, "User-Agent") == 0 || strcasecmp(token, "Connection") == 0 || strcasecmp(token, "Proxy-Connection") == 0)
+    {
+        free(line);
+        return;
+    }
+    /** conditionals are evaluated against the cache, not forwarded */
+    if (strcasecmp(token, "If-None-Match") == 0)
+    {
+        strcpy(req->if_none_match, saveptr);
+        free(line);
+        return;
+    }
+    if (strcasecmp(token, "If-Modified-Since") == 0)
+    {
+        strcpy(req->if_modified_since, saveptr);
+        free(line);
+        return;
+    }
+    /** ranges are cut out of the whole object, cached or fetched */
+    if (strcasecmp(token, "Range") == 0)
+    {
+        strcpy(req->range, saveptr);
+        free(line);
+        return;
+    }
+    if (strcasecmp(token, "If-Range") == 0)
+    {
+        strcpy(req->if_range, saveptr);
+        free(line);
+        return;
+    }
+    strcpy(req->headers[req->num_headers].name, token);
+    strcpy(req->headers[req->num_headers].value, saveptr);
+    req->num_headers++;
+    free(line);
+}
+
+/**
+ * @brief Compute the cache key of the request from its parsed URL
+ */
+void make_key(Request *req)
+{
+    if (key_from_url(&req->key, req->hostname, req->port, req->path, &key_options) < 0)
+    {
+        /** can't normalize it; the URL as sent is still a correct key */
+        req->key.len = strlen(req->url);
+        memcpy(req->key.data, req->url, req->key.len);
+        cache_key_hash(&req->key);
+    }
+}
+
+/**
+ * @brief The value of a request header the proxy forwards, or NULL
+ */
+const char *request_header(Request *req, const char *name)
+{
+    for (int i = 0; i < req->num_headers; i++)
+    {
+        if (strcasecmp(req->headers[i].name, name) == 0)
+            return req->headers[i].value;
+    }
+    return NULL;
+}
+
+/** add headers to the request */
+void add_headers(Request *req)
+{
+    int host_header_exists = 0;
+    for (int i = 0; i < req->num_headers; i++)
+    {
+        if (strcmp(req->headers[i].name, "Host") == 0)
+        {
+            host_header_exists = 1;
+            break;
+        }
+    }
+    if (!host_header_exists)
+    {
+        strcpy(req->headers[req->num_headers].name, "Host");
+        if (strlen(req->port) == 0)
+            sprintf(req->headers[req->num_headers].value, "%s", req->hostname);
+        else
+            sprintf(req->headers[req->num_headers].value, "%s:%s", req->hostname, req->port);
+        req->num_headers++;
+    }
+    strcpy(req->headers[req->num_headers].name, "User-Agent");
+    strcpy(req->headers[req->num_headers].value, user_agent);
+    req->num_headers++;
+    strcpy(req->headers[req->num_headers].name, "Connection");
+    strcpy(req->headers[req->num_headers].value, "close");
+    req->num_headers++;
+    strcpy(req->headers[req->num_headers].name, "Proxy-Connection");
+    strcpy(req->headers[req->num_headers].value, "close");
+    req->num_headers++;
+}
+
+/**
+ * @brief Describe the upstream request as spans for writev()
+ *
+ * Nothing is copied: the spans point at the method, path and headers in
+ * req, and at constant separators.
+ *
+ * @param iov Room for REQUEST_IOV(req) entries
+ * @return The number of entries filled in
+ */
+int assemble_request(Request *req, struct iovec *iov)
+{
+    int n = 0;
+
+    set_span(&iov[n++], req->method);
+    set_span(&iov[n++], " /");
+    set_span(&iov[n++], req->path);
+    set_span(&iov[n++], " ");
+    set_span(&iov[n++], "HTTP/1.0\r\n");
+    for (int i = 0; i < req->num_headers; i++)
+    {
+        set_span(&iov[n++], req->headers[i].name);
+        set_span(&iov[n++], ": ");
+        set_span(&iov[n++], req->headers[i].value);
+        set_span(&iov[n++], "\r\n");
+    }
+    set_span(&iov[n++], "\r\n");
+    return n;
+}
+
+void set_span(struct iovec *iov, const char *s)
+{
+    iov->iov_base = (char *)s;
+    iov->iov_len = strlen(s);
+}
+
+/**
+ * @brief Send the request assembled from req to the origin, in one writev()
+ *
+ * @return 0 on success, -1 if it couldn't be sent
+ */
+int send_request(Request *req, int serverfd)
+{
+    struct iovec *iov = malloc(sizeof(struct iovec) * REQUEST_IOV(req));
+    int n, rc;
+
+    if (iov == NULL)
+        return -1;
+    n = assemble_request(req, iov);
+    if (log_level >= LOG_LEVEL_DEBUG)
+    {
+        for (int i = 0; i < n; i++)
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+    }
+    rc = rio_writev(serverfd, iov, n) < 0 ? -1 : 0;
+    free(iov);
+    return rc;
+}
+
+int get_from_cache(Request *req, int clientfd, CachedResponse *stale)
+{
+    CachedResponse cached;
+    /** ranges are only cut out of the unencoded response */
+    if (req->gzip && req->range[0] == '\0' && get_encoded(req, clientfd))
+        return 1;
+    cached.key = req->key;
+    cached.size = get_from_cache_helper(&cached.key, (void **)&cached.value, &cached.meta);
+    trace_mark(&req->trace, TRACE_LOOKUP);
+    if (cached.size < 0)
+        return 0;
+    if (cached.meta.flags & CACHE_VARIANTS)
+    {
+        /** the URL's responses vary: look up the one for these request headers */
+        uint64_t variant = variant_key(req, cached.value, &cached.key);
+        free(cached.value);
+        cached.size = get_from_cache_helper(&cached.key, (void **)&cached.value, &cached.meta);
+        if (cached.size < 0)
+            return 0;
+        if (cached.meta.variant != variant)
+        {
+            /** another variant hashed to the same slot */
+            free(cached.value);
+            return 0;
+        }
+    }
+    cached.gzipped = (cached.meta.flags & CACHE_COMPRESSED) != 0;
+
+    time_t now = time(NULL);
+    int fresh = http_is_fresh(&cached.meta, now);
+    /** stored gzipped (-z): only a fresh hit for a gzip client goes out as is */
+    if ((!fresh || !req->gzip || req->range[0] != '\0') && expand_response(&cached) < 0)
+    {
+        free(cached.value);
+        return 0;
+    }
+    if (!fresh)
+    {
+        if (http_stale_while_revalidate(&cached.meta, now))
+        {
+            /** serve it now; one refresh per URL happens in the background */
+            LOG(LOG_LEVEL_DEBUG, "Stale in cache, refreshing in background");
+            send_cached(req, clientfd, &cached, now);
+            schedule_refresh(req, &cached);
+            return 1;
+        }
+        LOG(LOG_LEVEL_DEBUG, "Stale in cache");
+        /** keep it for a conditional request, or in case the origin fails */
+        if (http_has_validator(&cached.meta) || http_stale_if_error(&cached.meta, now))
+            *stale = cached;
+        else
+        {
+            free(cached.value);
+            stale->key = cached.key;
+        }
+        return 0;
+    }
+    LOG(LOG_LEVEL_DEBUG, "Found in cache");
+    /** first gzip-accepting client since it was cached: compress it once */
+    if (!(req->gzip && req->range[0] == '\0' && send_encoded(req, clientfd, &cached, now, 1)) &&
+        expand_response(&cached) == 0)
+        send_cached(req, clientfd, &cached, now);
+    free(cached.value);
+    return 1;
+}
+
+/**
+ * @brief Serve the gzip-encoded copy of the response, if a fresh one is cached
+ *
+ * @return 1 if it was sent
+ */
+int get_encoded(Request *req, int clientfd)
+{
+    CachedResponse encoded;
+    time_t now = time(NULL);
+
+    encoded.key = req->key;
+    key_add_encoding(&encoded.key);
+    encoded.size = get_from_cache_helper(&encoded.key, (void **)&encoded.value, &encoded.meta);
+    if (encoded.size < 0)
+        return 0;
+    trace_mark(&req->trace, TRACE_LOOKUP);
+    /** stale: the unencoded copy is revalidated, and compressed again */
+    if (!http_is_fresh(&encoded.meta, now))
+    {
+        free(encoded.value);
+        return 0;
+    }
+    LOG(LOG_LEVEL_DEBUG, "Found gzip in cache");
+    send_cached(req, clientfd, &encoded, now);
+    free(encoded.value);
+    return 1;
+}
+
+/**
+ * @brief gzip a complete response for a client that accepts it
+ *
+ * Only responses that vary on nothing but Accept-Encoding (the Vary
+ * store_response() adds) and aren't stored as a variant are encoded, so
+ * the encoded copy can live under a single key next to the URL's. A body
+ * the cache already holds gzipped is used as it is.
+ *
+ * @param encoded Set to the encoded response; its value is malloc'ed and
+ *        freed by the caller
+ * @return 1 if the response was encoded, 0 if it isn't worth it
+ */
+int encode_response(CachedResponse *cached, CachedResponse *encoded)
+{
+    CacheMeta *meta = &cached->meta;
+    size_t body_len = cached->size - meta->header_len, etag_len;
+    char vary[VARY_MAX], *body = NULL, headers[MAXBUF];
+    const char *gz;
+    ssize_t size;
+    size_t header_len;
+    uint32_t slot;
+    int nvary;
+
+    if ((meta->flags & (CACHE_CHUNKED | CACHE_VARIANTS)) || meta->variant != 0 ||
+        (nvary = http_vary(cached->value, meta->header_len, vary, sizeof(vary))) < 0 ||
+        (nvary > 0 && strcmp(vary, "accept-encoding") != 0))
+        return 0;
+    if (cached->gzipped)
+    {
+        gz = cached->value + meta->header_len;
+        size = body_len;
+    }
+    else
+    {
+        if (body_len < GZIP_MIN_SIZE || !http_compressible(cached->value, meta->header_len) ||
+            (size = gzip_compress(cached->value + meta->header_len, body_len, GZIP_LEVEL, &body)) < 0)
+            return 0;
+        gz = body;
+    }
+    header_len = http_encode_headers(cached->value, meta->header_len, size, headers,
+                                     sizeof(headers), &encoded->meta.age_slot);
+    if (header_len == 0 || (encoded->value = malloc(header_len + size)) == NULL)
+    {
+        free(body);
+        return 0;
+    }
+    memcpy(encoded->value, headers, header_len);
+    memcpy(encoded->value + header_len, gz, size);
+    free(body);
+    encoded->size = header_len + size;
+    slot = encoded->meta.age_slot;
+    encoded->meta = *meta;
+    encoded->meta.header_len = header_len;
+    encoded->meta.age_slot = slot;
+    encoded->meta.flags &= ~CACHE_COMPRESSED; /* its headers say gzip */
+    /** the ETag sent is weak now; keep the meta in step for If-None-Match */
+    if (meta->etag[0] == '"' && (etag_len = strlen(meta->etag)) + 2 < CACHE_ETAG_MAX)
+    {
+        memmove(encoded->meta.etag + 2, encoded->meta.etag, etag_len + 1);
+        memcpy(encoded->meta.etag, "W/", 2);
+    }
+    encoded->key = cached->key;
+    key_add_encoding(&encoded->key);
+    encoded->gzipped = 0;
+    return 1;
+}
+
+/**
+ * @brief Send a response gzipped, caching the encoded copy if store is set
+ *
+ * @return 1 if it was sent, 0 if it isn't worth encoding (nothing was sent)
+ */
+int send_encoded(Request *req, int clientfd, CachedResponse *cached, time_t now, int store)
+{
+    CachedResponse encoded;
+
+    if (!encode_response(cached, &encoded))
+        return 0;
+    /** no second copy of a body the cache already holds gzipped */
+    if (store && !cached->gzipped)
+        cache_URL(&encoded.key, encoded.value, encoded.size, &encoded.meta, cache);
+    send_cached(req, clientfd, &encoded, now);
+    free(encoded.value);
+    return 1;
+}
+
+/**
+ * @brief Gzip the body of a response about to be cached, if it compresses
+ *
+ * The headers stay the origin's; CACHE_COMPRESSED and the body length in
+ * meta tell expand_response() how to restore it.
+ *
+ * @param packed Set to a malloc'ed copy with the body gzipped, freed by
+ *        the caller
+ * @return The size of the copy, or 0 if the response is left as it is
+ */
+size_t pack_response(char *response, size_t size, CacheMeta *meta, char **packed)
+{
+    size_t body_len = size - meta->header_len;
+    ssize_t n;
+    char *body;
+
+    if ((meta->flags & CACHE_CHUNKED) || body_len < GZIP_MIN_SIZE ||
+        !http_compressible(response, meta->header_len) ||
+        (n = gzip_compress(response + meta->header_len, body_len, GZIP_FAST_LEVEL, &body)) < 0)
+        return 0;
+    if ((*packed = malloc(meta->header_len + n)) == NULL)
+    {
+        free(body);
+        return 0;
+    }
+    memcpy(*packed, response, meta->header_len);
+    memcpy(*packed + meta->header_len, body, n);
+    free(body);
+    meta->flags |= CACHE_COMPRESSED;
+    meta->length = body_len;
+    return meta->header_len + n;
+}
+
+/**
+ * @brief Inflate the body of a response the cache holds gzipped
+ *
+ * @return 0 on success or if it wasn't gzipped, -1 if it can't be inflated
+ */
+int expand_response(CachedResponse *cached)
+{
+    CacheMeta *meta = &cached->meta;
+    char *value;
+
+    if (!cached->gzipped)
+        return 0;
+    if ((value = malloc(meta->header_len + meta->length)) == NULL)
+        return -1;
+    memcpy(value, cached->value, meta->header_len);
+    if (gzip_decompress(cached->value + meta->header_len, cached->size - meta->header_len,
+                        value + meta->header_len, meta->length) != meta->length)
+    {
+        free(value);
+        return -1;
+    }
+    free(cached->value);
+    cached->value = value;
+    cached->size = meta->header_len + meta->length;
+    cached->gzipped = 0;
+    return 0;
+}
+
+/**
+ * @brief Send a fresh cached response, or a 304 if the client's
+ *        conditional headers say it already has it
+ */
+void send_cached(Request *req, int clientfd, CachedResponse *cached, time_t now)
+{
+    char *value = cached->value;
+    CacheMeta *meta = &cached->meta;
+    long age = http_current_age(meta, now);
+    int chunked = meta->flags & CACHE_CHUNKED;
+    char buf[MAXLINE];
+    struct iovec iov[3];
+
+    if (meta->status == 200 &&
+        http_not_modified(meta, req->if_none_match[0] ? req->if_none_match : NULL,
+                          req->if_modified_since[0] ? req->if_modified_since : NULL))
+    {
+        size_t n = http_build_not_modified(value, meta, age, buf, sizeof(buf));
+        relay(clientfd, buf, n);
+        return;
+    }
+    if (req->range[0] != '\0' && send_range(req, clientfd, cached, age))
+        return;
+
+    if (meta->age_slot != 0)
+    {
+        /** stored with an Age slot: patch it, and headers and body go out as one */
+        http_patch_age(value, meta->age_slot, age);
+        relay(clientfd, value, chunked ? meta->header_len : cached->size);
+    }
+    else
+    {
+        /** not from the cache: insert the Age before the blank line */
+        size_t blank = (meta->header_len >= 2 && value[meta->header_len - 2] == '\r') ? 2 : 1;
+        iov[0].iov_base = value;
+        iov[0].iov_len = meta->header_len - blank;
+        iov[1].iov_base = buf;
+        iov[1].iov_len = sprintf(buf, "Age: %ld\r\n\r\n", age);
+        iov[2].iov_base = value + meta->header_len;
+        iov[2].iov_len = chunked ? 0 : cached->size - meta->header_len;
+        if (clientfd >= 0 && rio_writev(clientfd, iov, 3) > 0)
+            metrics_add(METRIC_BYTES_SENT, iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+    }
+    if (chunked)
+        send_chunks(req, clientfd, cached, 0, meta->length);
+}
+
+/**
+ * @brief Build the cache key of the variant of req->key selected by the
+ *        request headers named in vary
+ *
+ * A URL has at most MAX_VARIANTS slots; a new variant takes over the slot
+ * its hash falls in. The full hash is kept in the variant's CacheMeta so a
+ * lookup never returns another variant's response.
+ *
+ * @param vary Lowercase field names joined by commas, from http_vary()
+ * @param key Set to the variant's key
+ * @return The variant hash
+ */
+uint64_t variant_key(Request *req, const char *vary, CacheKey *key)
+{
+    uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+    const char *field = vary;
+
+    while (*field != '\0')
+    {
+        size_t field_len = strcspn(field, ",");
+        const char *value = NULL;
+
+        for (int i = 0; i < req->num_headers; i++)
+        {
+            if (strlen(req->headers[i].name) == field_len &&
+                strncasecmp(req->headers[i].name, field, field_len) == 0)
+            {
+                value = req->headers[i].value;
+                break;
+            }
+        }
+        /** an absent header differs from an empty one */
+        hash = (hash ^ (value != NULL)) * 1099511628211ULL;
+        for (const char *c = value; c != NULL && *c != '\0'; c++)
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        hash = (hash ^ '\n') * 1099511628211ULL;
+
+        field += field_len;
+        if (*field == ',')
+            field++;
+    }
+    *key = req->key;
+    key_add_variant(key, hash % MAX_VARIANTS);
+    return hash;
+}
+
+/**
+ * @brief Cache a complete response under its URL, or, if it has a Vary
+ *        header, under its variant's key with the Vary list at the URL
+ *
+ * The stored headers get an Age slot, so hits don't rebuild them, and
+ * "Vary: Accept-Encoding" if a gzip client could be sent an encoded copy
+ * of the response instead.
+ *
+ * @param stored_as If not NULL, set to the key the response went under
+ */
+void store_response(Request *req, char *response, size_t size, CacheMeta *meta, CacheKey *stored_as)
+{
+    char vary[VARY_MAX], *packed = NULL, *slotted;
+    const char *extra = "";
+    CacheKey key;
+    CacheMeta index, stored;
+    size_t packed_size, header_len;
+    int nvary;
+
+    stored = *meta;
+    nvary = http_vary(response, meta->header_len, vary, sizeof(vary));
+    if (nvary == 0 && !(meta->flags & CACHE_CHUNKED) && size - meta->header_len >= GZIP_MIN_SIZE &&
+        http_compressible(response, meta->header_len))
+        extra = "Vary: Accept-Encoding\r\n";
+    if ((slotted = malloc(size + strlen(extra) + HTTP_AGE_SLOT_LEN)) == NULL)
+        return;
+    header_len = http_add_age_slot(response, meta->header_len, extra, slotted, &stored.age_slot);
+    memcpy(slotted + header_len, response + meta->header_len, size - meta->header_len);
+    size += header_len - meta->header_len;
+    stored.header_len = header_len;
+    response = slotted;
+
+    /** -z: bodies that compress are kept gzipped, to fit more in the budget */
+    if (config.compress && (packed_size = pack_response(response, size, &stored, &packed)) > 0)
+    {
+        response = packed;
+        size = packed_size;
+    }
+    if (nvary <= 0)
+    {
+        cache_URL(&req->key, response, size, &stored, cache);
+        /** an encoded copy is of the response this one replaces */
+        key = req->key;
+        key_add_encoding(&key);
+        cache_remove(&key, cache);
+        if (stored_as != NULL)
+            *stored_as = req->key;
+        free(packed);
+        free(slotted);
+        return;
+    }
+    meta->variant = stored.variant = variant_key(req, vary, &key);
+    index = *meta;
+    index.flags = CACHE_VARIANTS;
+    index.header_len = 0;
+    index.variant = 0;
+    cache_URL(&req->key, vary, strlen(vary) + 1, &index, cache);
+    cache_URL(&key, response, size, &stored, cache);
+    if (stored_as != NULL)
+        *stored_as = key;
+    free(packed);
+    free(slotted);
+}
+
+/**
+ * @brief Copy the header lines of a cached response for a 206, without
+ *        its status line, blank line and the headers the 206 replaces
+ *
+ * @param multipart Whether Content-Type is replaced too
+ * @param out Set to a malloc'ed copy, freed by the caller, or to NULL if
+ *        it can't be allocated
+ * @return The length of the copy
+ */
+size_t partial_headers(CachedResponse *cached, int multipart, char **out)
+{
+    size_t len = cached->meta.header_len;
+    char *headers = malloc(len + 1), *first;
+
+    if ((*out = headers) == NULL)
+        return 0;
+    memcpy(headers, cached->value, len);
+    len = http_strip_header(headers, len, "Content-Length");
+    len = http_strip_header(headers, len, "Content-Range");
+    len = http_strip_header(headers, len, "Age");
+    if (multipart)
+        len = http_strip_header(headers, len, "Content-Type");
+    while (len > 0 && (headers[len - 1] == '\n' || headers[len - 1] == '\r'))
+        len--;
+    if ((first = memchr(headers, '\n', len)) == NULL)
+        len = 0;
+    else
+    {
+        len -= first + 1 - headers;
+        memmove(headers, first + 1, len);
+    }
+    headers[len] = '\0';
+    *out = headers;
+    return len;
+}
+
+/**
+ * @brief Answer a Range request from a complete response
+ *
+ * One range gets a 206 with Content-Range; several get a
+ * multipart/byteranges body; none satisfiable gets a 416.
+ *
+ * @return 1 if the response was sent, 0 if the Range doesn't apply and
+ *         the whole response should be sent instead
+ */
+int send_range(Request *req, int clientfd, CachedResponse *cached, long age)
+{
+    HttpRange ranges[HTTP_MAX_RANGES];
+    CacheMeta *meta = &cached->meta;
+    const char *body = cached->value + meta->header_len;
+    int chunked = meta->flags & CACHE_CHUNKED;
+    size_t length = chunked ? meta->length : cached->size - meta->header_len, headers_len;
+    char buf[MAXLINE], *headers;
+    char boundary[40], *parts = NULL;
+    size_t parts_len = 0;
+    int n;
+
+    if (meta->status != 200 || !http_if_range(meta, req->if_range))
+        return 0;
+    if ((n = http_parse_range(req->range, length, ranges, HTTP_MAX_RANGES)) < 0)
+        return 0;
+    /** no multipart bodies out of chunks; sending it all is allowed too */
+    if (n > 1 && chunked)
+        return 0;
+    if (n == 0)
+    {
+        snprintf(buf, sizeof(buf), "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                                   "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n",
+                 length);
+        relay(clientfd, buf, strlen(buf));
+        return 1;
+    }
+
+    /** build everything before the status line goes out, so that running
+     *  out of memory can still fall back to the whole response */
+    if (n > 1)
+    {
+        snprintf(boundary, sizeof(boundary), "BYTERANGES_%016llx",
+                 (unsigned long long)__atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED) ^
+                     (unsigned long long)meta->response_time << 20);
+        if ((parts_len = byteranges(cached, ranges, n, length, boundary, &parts)) == 0)
+            return 0;
+    }
+    headers_len = partial_headers(cached, n > 1, &headers);
+    if (headers == NULL)
+    {
+        free(parts);
+        return 0;
+    }
+    snprintf(buf, sizeof(buf), "HTTP/1.0 206 Partial Content\r\n");
+    relay(clientfd, buf, strlen(buf));
+    relay(clientfd, headers, headers_len);
+    if (n == 1)
+    {
+        size_t count = ranges[0].last - ranges[0].first + 1;
+        snprintf(buf, sizeof(buf), "%sContent-Range: bytes %zu-%zu/%zu\r\n"
+                                   "Content-Length: %zu\r\nAge: %ld\r\n\r\n",
+                 headers_len > 0 ? "\r\n" : "", ranges[0].first, ranges[0].last,
+                 length, count, age);
+        relay(clientfd, buf, strlen(buf));
+        if (chunked)
+            send_chunks(req, clientfd, cached, ranges[0].first, count);
+        else
+            relay(clientfd, (void *)(body + ranges[0].first), count);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%sContent-Type: multipart/byteranges; boundary=%s\r\n"
+                                   "Content-Length: %zu\r\nAge: %ld\r\n\r\n",
+                 headers_len > 0 ? "\r\n" : "", boundary, parts_len, age);
+        relay(clientfd, buf, strlen(buf));
+        relay(clientfd, parts, parts_len);
+        free(parts);
+    }
+    free(headers);
+    return 1;
+}
+
+/**
+ * @brief Build the multipart/byteranges body for several ranges of a
+ *        complete response
+ *
+ * @param out Set to the malloc'ed body, freed by the caller
+ * @return The length of the body, or 0 if it can't be allocated
+ */
+size_t byteranges(CachedResponse *cached, HttpRange *ranges, int n, size_t length,
+                  const char *boundary, char **out)
+{
+    const char *body = cached->value + cached->meta.header_len;
+    const char *type = "application/octet-stream";
+    size_t type_len = strlen(type), total = 0, used = 0;
+    char *parts;
+
+    http_header_value(cached->value, cached->meta.header_len, "Content-Type", &type, &type_len);
+    for (int i = 0; i < n; i++)
+        total += ranges[i].last - ranges[i].first + 1 + type_len + 128;
+    if ((parts = malloc(total + 64)) == NULL)
+        return 0;
+    for (int i = 0; i < n; i++)
+    {
+        size_t count = ranges[i].last - ranges[i].first + 1;
+        used += sprintf(parts + used, "\r\n--%s\r\nContent-Type: %.*s\r\n"
+                                      "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                        boundary, (int)type_len, type, ranges[i].first,
+                        ranges[i].last, length);
+        memcpy(parts + used, body + ranges[i].first, count);
+        used += count;
+    }
+    used += sprintf(parts + used, "\r\n--%s--\r\n", boundary);
+    *out = parts;
+    return used;
+}
+
+/**
+ * @brief Pass a Range request through to the origin and relay its answer
+ *        uncached, for objects too large to fetch whole
+ */
+void forward_range(Request *req, int clientfd)
+{
+    char buf[MAXBUF];
+    rio_t rio_to_server;
+    int serverfd;
+    ssize_t n;
+
+    LOG(LOG_LEVEL_DEBUG, "Range of a large object, forwarding");
+    if ((serverfd = connect_origin(req)) < 0)
+    {
+        origin_error(req, clientfd, NULL, io_timed_out());
+        return;
+    }
+    if (send_range_request(req, req->range, req->if_range, serverfd) < 0)
+    {
+        origin_error(req, clientfd, NULL, io_timed_out());
+        close(serverfd);
+        return;
+    }
+    origin_timeout(serverfd, config.first_byte_timeout, 0);
+
+    Rio_readinitb(&rio_to_server, serverfd);
+    n = rio_readnb(&rio_to_server, buf, MAXBUF);
+    if (n < 0)
+        origin_error(req, clientfd, NULL, io_timed_out());
+    else
+        origin_timeout(serverfd, config.idle_timeout, 0);
+    for (; n > 0; n = rio_readnb(&rio_to_server, buf, MAXBUF))
+    {
+        if (relay(clientfd, buf, n) < 0)
+            break;
+    }
+    close(serverfd);
+}
+
+/**
+ * @brief Send req to the origin as a Range request
+ *
+ * The conditionals add_conditional_headers() may have added for our stale
+ * copy are dropped: the answer is for the client or for a chunk, and a
+ * 304 would be no use to either.
+ *
+ * @param if_range If-Range value, or "" for none
+ * @return As send_request()
+ */
+int send_range_request(Request *req, const char *range, const char *if_range, int serverfd)
+{
+    int i, j, rc;
+
+    for (i = 0, j = 0; i < req->num_headers; i++)
+    {
+        if (strcasecmp(req->headers[i].name, "If-None-Match") != 0 &&
+            strcasecmp(req->headers[i].name, "If-Modified-Since") != 0)
+            req->headers[j++] = req->headers[i];
+    }
+    req->num_headers = j;
+    strcpy(req->headers[j].name, "Range");
+    strcpy(req->headers[j++].value, range);
+    if (if_range[0] != '\0')
+    {
+        strcpy(req->headers[j].name, "If-Range");
+        strcpy(req->headers[j++].value, if_range);
+    }
+    req->num_headers = j;
+    rc = send_request(req, serverfd);
+    /** leave req as it was for the next chunk */
+    req->num_headers -= if_range[0] != '\0' ? 2 : 1;
+    return rc;
+}
+
+/**
+ * @brief Send count bytes of a chunked object's body, starting at offset
+ *
+ * Chunks that have been evicted, or that belong to an older copy of the
+ * object, are fetched again with a Range request and cached.
+ *
+ * @return 0 on success, -1 if a chunk couldn't be had; the client then
+ *         gets a short response and the object is dropped
+ */
+int send_chunks(Request *req, int clientfd, CachedResponse *cached, size_t offset, size_t count)
+{
+    size_t end = offset + count;
+    CacheKey key;
+    CacheMeta meta;
+    char *data;
+    ssize_t size;
+
+    while (offset < end)
+    {
+        uint32_t index = offset / CHUNK_SIZE;
+        size_t start = (size_t)index * CHUNK_SIZE, n;
+
+        key = cached->key;
+        key_add_chunk(&key, index);
+        size = cache_get(&key, (void **)&data, &meta, cache);
+        if (size >= 0 && meta.object_id != cached->meta.object_id)
+        {
+            free(data);
+            size = -1;
+        }
+        if (size < 0 && (size = fetch_chunk(req, cached, index, &data)) < 0)
+        {
+            cache_remove(&cached->key, cache);
+            return -1;
+        }
+        if (start + size <= offset)
+        {
+            free(data);
+            cache_remove(&cached->key, cache);
+            return -1;
+        }
+        n = (start + size < end ? start + size : end) - offset;
+        if (relay(clientfd, data + (offset - start), n) < 0)
+        {
+            /** the client went away; the object is fine */
+            free(data);
+            return 0;
+        }
+        free(data);
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fetch one chunk of a chunked object from the origin and cache it
+ *
+ * If-Range makes sure the bytes come from the same version of the object;
+ * anything but a 206 for exactly this chunk is a failure.
+ *
+ * @param data Set to a malloc'ed copy of the chunk, freed by the caller
+ * @return The chunk's length, or -1
+ */
+ssize_t fetch_chunk(Request *req, CachedResponse *cached, uint32_t index, char **data)
+{
+    CacheMeta *meta = &cached->meta;
+    size_t first = (size_t)index * CHUNK_SIZE, last, count;
+    size_t range_first, range_last, range_length;
+    char buf[MAXLINE], range[64], if_range[CACHE_ETAG_MAX + 32];
+    const char *value;
+    size_t value_len;
+    char *headers;
+    size_t headers_len = 0;
+    rio_t rio_to_server;
+    int serverfd;
+    ssize_t n;
+
+    if (first >= (size_t)meta->length)
+        return -1;
+    last = (first + CHUNK_SIZE < (size_t)meta->length ? first + CHUNK_SIZE : meta->length) - 1;
+    count = last - first + 1;
+    LOG(LOG_LEVEL_DEBUG, "Fetching chunk %u", index);
+    if ((serverfd = connect_origin(req)) < 0)
+        return -1;
+
+    snprintf(range, sizeof(range), "bytes=%zu-%zu", first, last);
+    if (meta->etag[0] == '"') /* If-Range needs a strong validator */
+        snprintf(if_range, sizeof(if_range), "%s", meta->etag);
+    else if (meta->last_modified != 0)
+        http_format_date(meta->last_modified, if_range, sizeof(if_range));
+    else
+        if_range[0] = '\0';
+    if (send_range_request(req, range, if_range, serverfd) < 0)
+    {
+        close(serverfd);
+        return -1;
+    }
+    /** the client is waiting on this chunk: one deadline for all of it */
+    origin_timeout(serverfd, config.first_byte_timeout, time(NULL) + config.total_timeout);
+
+    /** status line and headers */
+    Rio_readinitb(&rio_to_server, serverfd);
+    if ((headers = malloc(MAXBUF)) == NULL)
+    {
+        close(serverfd);
+        return -1;
+    }
+    while ((n = rio_readlineb(&rio_to_server, buf, MAXLINE)) > 0 && headers_len + n <= MAXBUF)
+    {
+        memcpy(headers + headers_len, buf, n);
+        headers_len += n;
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0)
+            break;
+    }
+    if (http_status(headers, headers_len) != 206 ||
+        !http_header_value(headers, headers_len, "Content-Range", &value, &value_len) ||
+        sscanf(value, "bytes %zu-%zu/%zu", &range_first, &range_last, &range_length) != 3 ||
+        range_first != first || range_last != last || range_length != (size_t)meta->length)
+    {
+        free(headers);
+        close(serverfd);
+        return -1;
+    }
+    free(headers);
+
+    if ((*data = malloc(count)) == NULL)
+    {
+        close(serverfd);
+        return -1;
+    }
+    n = rio_readnb(&rio_to_server, *data, count);
+    close(serverfd);
+    if (n < 0 || (size_t)n != count)
+    {
+        free(*data);
+        return -1;
+    }
+    store_chunk(&cached->key, index, *data, count, meta);
+    return count;
+}
+
+/**
+ * @brief Cache chunk number index of the chunked object cached under object
+ *
+ * @param meta The object's record; chunks carry a copy so a chunk of an
+ *        older copy of the object is never mistaken for one of this copy
+ */
+void store_chunk(const CacheKey *object, uint32_t index, char *data, size_t size, CacheMeta *meta)
+{
+    CacheKey key = *object;
+    CacheMeta chunk_meta = *meta;
+
+    key_add_chunk(&key, index);
+    chunk_meta.header_len = 0;
+    cache_URL(&key, data, size, &chunk_meta, cache);
+}
+
+/**
+ * @brief A new id for a chunked object, unique across the processes
+ *        sharing the cache
+ */
+uint64_t new_object_id(void)
+{
+    static uint64_t counter = 0;
+
+    return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^
+           __sync_fetch_and_add(&counter, 1);
+}
+
+/**
+ * @brief: get a copy of the value of the key from the shared cache
+ * @param key: the key to be searched, from make_key()
+ * @param value: set to a malloc'ed copy of the value, freed by the caller
+ * @param meta: set to the freshness record of the value
+ * @return: the size of the value if found, -1 otherwise
+ */
+ssize_t get_from_cache_helper(CacheKey *key, void **value, CacheMeta *meta)
+{
+    return cache_get(key, value, meta, cache);
+}
+
+/**
+ * @brief Get the from server object
+ *
+ * @param req The request object
+ * @param clientfd The client file descriptor
+ * @param rio_to_client The rio object to the client
+ */
+void get_from_server(Request *req, int clientfd, rio_t rio_to_client, CachedResponse *stale)
+{
+    ssize_t n;
+    int serverfd;
+    char buf[MAXLINE];
+    rio_t rio_to_server;
+    CacheMeta meta;
+    time_t request_time, response_time, deadline;
+    int timeout, timed_out = 0;
+    Trace *trace = &req->trace;
+
+    if ((serverfd = connect_origin(req)) < 0)
+    {
+        origin_error(req, clientfd, stale, io_timed_out());
+        return;
+    }
+    metrics_observe(METRIC_CONNECT_TIME, trace->at[TRACE_CONNECTED] - trace->at[TRACE_RESOLVED]);
+
+    Rio_readinitb(&rio_to_server, serverfd);
+    if (stale->value != NULL && http_has_validator(&stale->meta))
+        add_conditional_headers(req, &stale->meta);
+    request_time = time(NULL);
+    deadline = config.total_timeout > 0 ? request_time + config.total_timeout : 0;
+    if (send_request(req, serverfd) < 0)
+    {
+        origin_error(req, clientfd, stale, io_timed_out());
+        close(serverfd);
+        return;
+    }
+    timeout = origin_timeout(serverfd, config.first_byte_timeout, deadline);
+    trace_mark(trace, TRACE_SENT);
+    /** the limit may change on a reload: stick to one for this response */
+    size_t max_object_size = cache->max_object_size;
+    char *full_response = malloc(max_object_size);
+    if (full_response == NULL)
+    {
+        if (clientfd >= 0)
+            client_error(clientfd, "503", "Service Unavailable", "Out of memory");
+        close(serverfd);
+        return;
+    }
+    size_t full_response_size = 0;
+    int cacheable = 0;
+    int too_large = 0;
+    int header_done = 0;
+    int whole = 0;  /* holding the whole response to cut a range out of it */
+    int encode = 0; /* holding the whole response to gzip it */
+
+    /** status line and headers: hold them until we know what to do */
+    while ((n = rio_readlineb(&rio_to_server, buf, MAXLINE)) > 0)
+    {
+        if (full_response_size == 0 && !too_large)
+        {
+            trace_mark(trace, TRACE_FIRST_BYTE);
+            metrics_observe(METRIC_FIRST_BYTE_TIME, trace->at[TRACE_FIRST_BYTE] - trace->at[TRACE_SENT]);
+            timeout = origin_timeout(serverfd, config.idle_timeout, deadline);
+        }
+        if (!too_large && full_response_size + n <= max_object_size)
+        {
+            memcpy(full_response + full_response_size, buf, n);
+            full_response_size += n;
+        }
+        else
+        {
+            /** headers too large to hold: give up on caching and stream them */
+            if (!too_large)
+                relay(clientfd, full_response, full_response_size);
+            too_large = 1;
+            relay(clientfd, buf, n);
+        }
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0)
+        {
+            header_done = 1;
+            break;
+        }
+    }
+    response_time = time(NULL);
+    if (n < 0 && !too_large)
+    {
+        /** nothing sent yet: answer for the origin; read errno before logging */
+        timed_out = io_timed_out();
+        LOG(LOG_LEVEL_WARN, "Origin %s for %s", timed_out ? "timed out" : "failed", req->url);
+        origin_error(req, clientfd, stale, timed_out);
+        free(full_response);
+        close(serverfd);
+        return;
+    }
+
+    if (!too_large && header_done && stale->value != NULL &&
+        http_status(full_response, full_response_size) == 304)
+    {
+        /** our copy is still good: freshen its record and serve it */
+        LOG(LOG_LEVEL_DEBUG, "Revalidated");
+        http_parse_not_modified(full_response, full_response_size, request_time,
+                                response_time, &stale->meta, &meta);
+        cache_update_meta(&stale->key, &stale->meta, &meta, cache);
+        stale->meta = meta;
+        if (clientfd >= 0)
+            send_cached(req, clientfd, stale, response_time);
+        free(full_response);
+        close(serverfd);
+        return;
+    }
+    if (!too_large && (!header_done || http_status(full_response, full_response_size) >= 500) &&
+        serve_stale_on_error(req, clientfd, stale))
+    {
+        /** the origin is failing; keep the stale copy rather than its error */
+        free(full_response);
+        close(serverfd);
+        return;
+    }
+    CachedResponse object; /* a chunked object's headers, once cached */
+    long length = -1;
+    int chunked = 0;
+    if (!too_large)
+    {
+        if (header_done)
+        {
+            cacheable = http_parse_response(full_response, full_response_size,
+                                            request_time, response_time, &meta);
+            if (meta.status == 200)
+                length = http_content_length(full_response, full_response_size);
+        }
+        int big = length > (long)(max_object_size - full_response_size);
+        if (header_done && meta.status == 200 && req->range[0] != '\0' && clientfd >= 0)
+        {
+            HttpRange range;
+            if (!big)
+                whole = 1;
+            else if (!cacheable || !http_if_range(&meta, req->if_range) ||
+                     http_parse_range(req->range, length, &range, 1) != 1)
+            {
+                /** too large to hold and not worth chunking: the origin cuts the range */
+                free(full_response);
+                close(serverfd);
+                forward_range(req, clientfd);
+                return;
+            }
+        }
+        if (header_done && !whole && !big && req->gzip && req->range[0] == '\0' && clientfd >= 0 &&
+            http_compressible(full_response, full_response_size))
+            encode = 1;
+        if (!whole && !encode && !(big && cacheable && req->range[0] != '\0' && clientfd >= 0))
+            relay(clientfd, full_response, full_response_size);
+        /** Age is recomputed on every hit, so don't store the origin's */
+        full_response_size = http_strip_header(full_response, full_response_size, "Age");
+        meta.header_len = full_response_size;
+
+        if (big && cacheable)
+        {
+            /** too large for one entry: cache the headers now, the body in chunks */
+            meta.flags |= CACHE_CHUNKED;
+            meta.length = length;
+            meta.object_id = new_object_id();
+            store_response(req, full_response, full_response_size, &meta, &object.key);
+            object.value = full_response;
+            object.size = full_response_size;
+            object.meta = meta;
+            chunked = 1;
+            cacheable = 0;
+            if (req->range[0] != '\0' && clientfd >= 0)
+            {
+                /** only the chunks the range needs are fetched, as it is sent */
+                close(serverfd);
+                send_cached(req, clientfd, &object, response_time);
+                free(full_response);
+                return;
+            }
+        }
+    }
+
+    /** body */
+    char *chunk = NULL;
+    if (chunked && (chunk = malloc(CHUNK_SIZE)) == NULL)
+    {
+        /** serve the body uncached rather than fail the request */
+        cache_remove(&object.key, cache);
+        chunked = 0;
+    }
+    size_t chunk_size = 0, received = 0;
+    uint32_t index = 0;
+    while ((n = rio_readnb(&rio_to_server, buf, MAXBUF)) > 0)
+    {
+        if (deadline != 0 && deadline - time(NULL) < timeout)
+        {
+            /** the response's own deadline is now the nearer one */
+            if (time(NULL) >= deadline)
+            {
+                timed_out = 1;
+                break;
+            }
+            timeout = origin_timeout(serverfd, timeout, deadline);
+        }
+        if (chunked)
+        {
+            /** cache each chunk as soon as it is complete */
+            for (size_t done = 0; done < n;)
+            {
+                size_t take = n - done < CHUNK_SIZE - chunk_size ? n - done : CHUNK_SIZE - chunk_size;
+                memcpy(chunk + chunk_size, buf + done, take);
+                chunk_size += take;
+                done += take;
+                received += take;
+                if (chunk_size == CHUNK_SIZE || received == (size_t)length)
+                {
+                    store_chunk(&object.key, index++, chunk, chunk_size, &meta);
+                    chunk_size = 0;
+                }
+            }
+        }
+        else if ((cacheable || whole || encode) && full_response_size + n <= max_object_size)
+        {
+            /** copy the response buffer to the full_response */
+            memcpy(full_response + full_response_size, buf, n);
+            full_response_size += n;
+        }
+        else if (whole)
+        {
+            /** larger than it said; nothing has been sent yet, so start over */
+            free(full_response);
+            close(serverfd);
+            forward_range(req, clientfd);
+            return;
+        }
+        else if (encode)
+        {
+            /** too large to hold: send what we have and stream the rest as is */
+            relay(clientfd, full_response, full_response_size);
+            encode = 0;
+            cacheable = 0;
+        }
+        else
+            cacheable = 0;
+
+        if (!whole && !encode && relay(clientfd, buf, n) < 0)
+        {
+            /** the client went away: finish the response for the cache only */
+            clientfd = -1;
+            if (!cacheable && !chunked)
+                break;
+        }
+    }
+    if (n < 0 || timed_out)
+    {
+        /** cut off: a client mid-body gets a short response, one waiting on
+         * a buffered response gets an error; neither is cached */
+        timed_out = timed_out || io_timed_out();
+        LOG(LOG_LEVEL_WARN, "Origin %s for %s", timed_out ? "timed out" : "failed", req->url);
+        if (whole || encode)
+            origin_error(req, clientfd, NULL, timed_out);
+        else
+            metrics_add(timed_out ? METRIC_ORIGIN_TIMEOUTS : METRIC_ORIGIN_ERRORS, 1);
+        whole = 0;
+        encode = 0;
+        cacheable = 0;
+    }
+    if (whole)
+    {
+        CachedResponse fetched;
+        fetched.value = full_response;
+        fetched.size = full_response_size;
+        fetched.meta = meta;
+        send_cached(req, clientfd, &fetched, response_time);
+    }
+    if (chunked)
+    {
+        /** cut short or overlong: the chunks don't add up to the object */
+        if (received != (size_t)length)
+            cache_remove(&object.key, cache);
+        free(chunk);
+    }
+    else if (cacheable)
+    {
+        /** add to cache */
+        store_response(req, full_response, full_response_size, &meta, NULL);
+    }
+    else if (stale->key.len != 0)
+    {
+        /** whatever we had for this request is stale and can't be replaced */
+        cache_remove(&stale->key, cache);
     }
-}
\ No newline at end of file
+    if (encode)
+    {
+        /** after the unencoded copy is stored, since that drops any encoded one */
+        CachedResponse fetched;
+        fetched.value = full_response;
+        fetched.size = full_response_size;
+        fetched.meta = meta;
+        fetched.key = req->key;
+        fetched.gzipped = 0;
+        /** with -z the stored copy is gzipped already and serves gzip clients */
+        if (!send_encoded(req, clientfd, &fetched, response_time, cacheable && !config.compress))
+            send_cached(req, clientfd, &fetched, response_time);
+    }
+    free(full_response);
+    close(serverfd);
+}
+
+/**
+ * @brief stale-if-error: answer with the stale copy when the origin can't
+ *
+ * @return 1 if the stale copy was usable (and sent, if there is a client)
+ */
+int serve_stale_on_error(Request *req, int clientfd, CachedResponse *stale)
+{
+    time_t now = time(NULL);
+
+    if (stale->value == NULL || !http_stale_if_error(&stale->meta, now))
+        return 0;
+    LOG(LOG_LEVEL_WARN, "Origin failed, serving stale %s", req->url);
+    if (clientfd >= 0)
+        send_cached(req, clientfd, stale, now);
+    return 1;
+}
+
+/**
+ * @brief Queue a background refresh of a stale entry
+ *
+ * Only one refresh per entry runs at a time across all processes sharing
+ * the cache: the first caller claims the entry, the rest do nothing. If
+ * the queue is full the refresh is dropped; the claim expires after
+ * REFRESH_CLAIM_TIMEOUT and a later hit tries again.
+ *
+ * @param stale The stale copy; its value is taken over (and freed) here
+ */
+void schedule_refresh(Request *req, CachedResponse *stale)
+{
+    RefreshJob *job;
+
+    if (!cache_claim_refresh(&stale->key, &stale->meta, time(NULL), REFRESH_CLAIM_TIMEOUT, cache))
+    {
+        free(stale->value);
+        return;
+    }
+    pthread_once(&refresh_once, start_refresh_workers);
+
+    pthread_mutex_lock(&refresh_mutex);
+    if (refresh_queued >= REFRESH_QUEUE || (job = malloc(sizeof(RefreshJob))) == NULL)
+    {
+        pthread_mutex_unlock(&refresh_mutex);
+        free(stale->value);
+        return;
+    }
+    memcpy(&job->req, req, sizeof(Request));
+    if ((job->req.headers = malloc(sizeof(header_t) * req->max_headers)) == NULL)
+    {
+        pthread_mutex_unlock(&refresh_mutex);
+        free(job);
+        free(stale->value);
+        return;
+    }
+    memcpy(job->req.headers, req->headers, sizeof(header_t) * req->num_headers);
+    job->stale = *stale;
+    job->next = NULL;
+    if (refresh_tail == NULL)
+        refresh_head = job;
+    else
+        refresh_tail->next = job;
+    refresh_tail = job;
+    refresh_queued++;
+    pthread_cond_signal(&refresh_ready);
+    pthread_mutex_unlock(&refresh_mutex);
+    /** counted as a connection so a draining proxy finishes it */
+    connection_start();
+}
+
+/**
+ * @brief Start the refresh pool; called once per process, after any fork()
+ */
+void start_refresh_workers(void)
+{
+    pthread_t tid;
+
+    for (int i = 0; i < REFRESH_WORKERS; i++)
+        Pthread_create(&tid, NULL, refresh_worker, NULL);
+}
+
+void *refresh_worker(void *vargp)
+{
+    rio_t no_client;
+    RefreshJob *job;
+
+    Pthread_detach(pthread_self());
+    memset(&no_client, 0, sizeof(no_client));
+    while (1)
+    {
+        pthread_mutex_lock(&refresh_mutex);
+        while (refresh_head == NULL)
+            pthread_cond_wait(&refresh_ready, &refresh_mutex);
+        job = refresh_head;
+        refresh_head = job->next;
+        if (refresh_head == NULL)
+            refresh_tail = NULL;
+        refresh_queued--;
+        pthread_mutex_unlock(&refresh_mutex);
+
+        LOG(LOG_LEVEL_DEBUG, "Refreshing %s", job->req.url);
+        get_from_server(&job->req, -1, no_client, &job->stale);
+        free(job->stale.value);
+        free(job->req.headers);
+        free(job);
+        connection_done();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connect to the origin of req, within the connect timeout
+ *
+ * @return The socket, or -1 with errno set (ETIMEDOUT if it took too long)
+ */
+int connect_origin(Request *req)
+{
+    struct addrinfo *list;
+    int fd;
+
+    if ((list = io_resolve(req->hostname, req->port)) == NULL)
+        return -1;
+    trace_mark(&req->trace, TRACE_RESOLVED);
+    PROBE2(origin__connect__start, req->hostname, req->port);
+    fd = io_connect(list, config.connect_timeout);
+    PROBE2(origin__connect__done, req->hostname, fd);
+    freeaddrinfo(list);
+    if (fd >= 0)
+        trace_mark(&req->trace, TRACE_CONNECTED);
+    return fd;
+}
+
+/**
+ * @brief Bound each read from the origin by timeout seconds, and all of
+ *        them by the deadline (0 for none)
+ *
+ * @return The timeout set, 0 for none
+ */
+int origin_timeout(int serverfd, int timeout, time_t deadline)
+{
+    if (deadline != 0)
+    {
+        time_t left = deadline - time(NULL);
+        if (left < 1)
+            left = 1;
+        if (timeout == 0 || left < timeout)
+            timeout = left;
+    }
+    io_set_timeout(serverfd, SO_RCVTIMEO, timeout);
+    return timeout;
+}
+
+/**
+ * @brief Answer for an origin that couldn't be reached or didn't respond:
+ *        the stale copy if stale-if-error allows, 504 if it timed out, 502
+ *
+ * @param stale The stale copy, or NULL for none
+ */
+void origin_error(Request *req, int clientfd, CachedResponse *stale, int timed_out)
+{
+    metrics_add(timed_out ? METRIC_ORIGIN_TIMEOUTS : METRIC_ORIGIN_ERRORS, 1);
+    if (stale != NULL && serve_stale_on_error(req, clientfd, stale))
+        return;
+    if (clientfd < 0)
+        return;
+    if (timed_out)
+        client_error(clientfd, "504", "Gateway Timeout", "The origin server did not answer in time");
+    else
+        client_error(clientfd, "502", "Bad Gateway", "Could not connect to the origin server");
+}
+
+/**
+ * @brief Write to the client, if there is one (background refreshes have none)
+ *
+ * A client that has gone away or stopped reading (client_timeout) is not
+ * fatal: the write fails and the connection is closed as usual.
+ *
+ * @return 0 on success, -1 if the write failed
+ */
+int relay(int clientfd, void *buf, size_t n)
+{
+    if (clientfd < 0)
+        return 0;
+    if (rio_writen(clientfd, buf, n) < 0)
+        return -1;
+    metrics_add(METRIC_BYTES_SENT, n);
+    PROBE2(relay__bytes, clientfd, n);
+    return 0;
+}
+
+/**
+ * @brief Answer a request for METRICS_PATH with the metrics page
+ */
+void serve_metrics(int clientfd)
+{
+    char header[MAXLINE], *page;
+    size_t len;
+
+    if ((page = malloc(METRICS_PAGE)) == NULL)
+    {
+        client_error(clientfd, "503", "Service Unavailable", "Out of memory");
+        return;
+    }
+    len = metrics_render(page, METRICS_PAGE, cache);
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                     "Content-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\n\r\n",
+             len);
+    if (relay(clientfd, header, strlen(header)) == 0)
+        relay(clientfd, page, len);
+    free(page);
+}
+
+/**
+ * @brief Send an error response to the client
+ */
+void client_error(int fd, char *errnum, char *shortmsg, char *longmsg)
+{
+    char buf[MAXLINE], body[MAXBUF];
+
+    snprintf(body, sizeof(body), "<html><head><title>%s %s</title></head>"
+                                 "<body><p>%s</p></body></html>",
+             errnum, shortmsg, longmsg);
+    snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+                               "Content-length: %d\r\n\r\n",
+             errnum, shortmsg, (int)strlen(body));
+    if (relay(fd, buf, strlen(buf)) == 0)
+        relay(fd, body, strlen(body));
+}
+
+/**
+ * @brief Make the upstream request conditional on the stale copy's validators
+ */
+void add_conditional_headers(Request *req, CacheMeta *meta)
+{
+    if (meta->etag[0] != '\0')
+    {
+        strcpy(req->headers[req->num_headers].name, "If-None-Match");
+        strcpy(req->headers[req->num_headers].value, meta->etag);
+        req->num_headers++;
+    }
+    if (meta->last_modified != 0)
+    {
+        strcpy(req->headers[req->num_headers].name, "If-Modified-Since");
+        http_format_date(meta->last_modified, req->headers[req->num_headers].value, MAXLINE);
+        req->num_headers++;
+    }
+}
+
+void close_wrapper(int fd)
+{
+    close(fd);
+}
+
+/**
+ * @brief The numeric address of the peer on fd, for the access log
+ */
+void peer_name(int fd, char *buf, size_t len)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (getpeername(fd, (SA *)&addr, &addrlen) < 0 ||
+        getnameinfo((SA *)&addr, addrlen, buf, len, NULL, 0, NI_NUMERICHOST) != 0)
+        snprintf(buf, len, "-");
+}
+
+void print_full(char *string)
+{
+    printf("%s\n", string);
+}
+void print_struct(Request *req)
+{
+    log_write(LOG_LEVEL_DEBUG, "Method: %s", req->method == NULL ? "NULL" : req->method);
+    log_write(LOG_LEVEL_DEBUG, "URL: %s", req->url == NULL ? "NULL" : req->url);
+    log_write(LOG_LEVEL_DEBUG, "Hostname: %s", req->hostname == NULL ? "NULL" : req->hostname);
+    log_write(LOG_LEVEL_DEBUG, "Port: %s", req->port == NULL ? "NULL" : req->port);
+    log_write(LOG_LEVEL_DEBUG, "Path: %s", req->path == NULL ? "NULL" : req->path);
+    log_write(LOG_LEVEL_DEBUG, "Version: %s", req->version == NULL ? "NULL" : req->version);
+    for (int i = 0; i < req->num_headers; i++)
+    {
+        log_write(LOG_LEVEL_DEBUG, "Header %d: %s: %s", i, req->headers[i].name, req->headers[i].value);
+    }
+}
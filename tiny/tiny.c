@@ -2,8 +2,15 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *
+ *     With -b it is instead a benchmark origin: see bench_main().
  */
 #include "csapp.h"
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+
+/* Room for the longest type get_filetype() names */
+#define FILETYPE_MAX 32
 
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
@@ -14,6 +21,24 @@ void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
+/* Benchmark mode, at the end of the file */
+typedef struct {
+    int http11;             /* request was HTTP/1.1 */
+    int keepalive;          /* connection stays open after the response */
+    char inm[MAXLINE];      /* If-None-Match, or "" */
+} benchreq_t;
+
+int bench_main(int argc, char **argv);
+void *bench_thread(void *vargp);
+int bench_request(int fd, rio_t *rp);
+int bench_requesthdrs(rio_t *rp, benchreq_t *rq);
+void bench_header(char *buf, benchreq_t *rq, char *status);
+int bench_static(int fd, char *filename, int filesize, benchreq_t *rq);
+int bench_synth(int fd, char *uri, benchreq_t *rq);
+int bench_body(int fd, long len, int chunked, int slow);
+int bench_dynamic(int fd, char *filename, char *cgiargs);
+int bench_error(int fd, char *errnum, char *shortmsg, benchreq_t *rq);
+
 int main(int argc, char **argv) 
 {
     int listenfd, connfd;
@@ -21,9 +46,12 @@ int main(int argc, char **argv)
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+	return bench_main(argc, argv);
+
     /* Check command line args */
     if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	fprintf(stderr, "usage: %s [-b] <port>\n", argv[0]);
 	exit(1);
     }
 
@@ -149,15 +177,15 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 void serve_static(int fd, char *filename, int filesize) 
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char *srcp, filetype[FILETYPE_MAX], buf[MAXBUF];
  
     /* Send response headers to client */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
     sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Connection: close\r\n");
+    sprintf(buf + strlen(buf), "Content-length: %d\r\n", filesize);
+    sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);
     Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
     printf("Response headers:\n");
     printf("%s", buf);
@@ -223,10 +251,10 @@ void clienterror(int fd, char *cause, char *errnum,
 
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    sprintf(body + strlen(body), "<body bgcolor=""ffffff"">\r\n");
+    sprintf(body + strlen(body), "%s: %s\r\n", errnum, shortmsg);
+    sprintf(body + strlen(body), "<p>%s: %s\r\n", longmsg, cause);
+    sprintf(body + strlen(body), "<hr><em>The Tiny Web server</em>\r\n");
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
@@ -238,3 +266,333 @@ void clienterror(int fd, char *cause, char *errnum,
     Rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
+
+/*
+ * Benchmark mode - "tiny -b <port>" is an origin that keeps up with
+ *     the proxy under load: each connection gets its own thread and is
+ *     kept alive (HTTP/1.1, or HTTP/1.0 with "Connection: keep-alive"),
+ *     static files go out with sendfile, and nothing is printed per
+ *     request.
+ *
+ *     URIs under /synth are made up on the spot, shaped by the query:
+ *       size=N      body of N bytes (default 1024)
+ *       delay=MS    wait MS milliseconds before answering
+ *       maxage=S    send "Cache-Control: max-age=S"
+ *       etag=1      send an ETag, and a 304 to a matching If-None-Match
+ *       chunked=1   chunked body (HTTP/1.1; to HTTP/1.0 it runs to the close)
+ *       fault=F     reset: close with a RST instead of answering
+ *                   stall: never answer, like nop-server.py
+ *                   slow:  trickle the body out BENCH_SLOW_BYTES at a time
+ *                   close: send half the body, then close
+ *     e.g. /synth?size=65536&maxage=60&etag=1
+ */
+/* $begin bench */
+#define BENCH_CHUNK 8192               /* body bytes per write */
+#define BENCH_MAXSIZE (1L << 30)
+#define BENCH_SLOW_BYTES 512
+#define BENCH_SLOW_US 100000           /* between slow writes */
+
+char bench_fill[BENCH_CHUNK];          /* what synthetic bodies are made of */
+
+int bench_main(int argc, char **argv)
+{
+    int i, listenfd, connfd, on = 1;
+    pthread_t tid;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s -b <port>\n", argv[0]);
+	exit(1);
+    }
+    for (i = 0; i < BENCH_CHUNK; i++)
+	bench_fill[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+
+    Signal(SIGPIPE, SIG_IGN);          /* a vanished client is just an error */
+    listenfd = Open_listenfd(argv[2]);
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    while (1) {
+	if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+	    continue;
+	/* a CGI child gets its own connection as stdout, not the others */
+	fcntl(connfd, F_SETFD, FD_CLOEXEC);
+	setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (pthread_create(&tid, NULL, bench_thread, (void *)(long)connfd) != 0)
+	    close(connfd);
+    }
+}
+
+/*
+ * bench_thread - serve one connection until it closes
+ */
+void *bench_thread(void *vargp)
+{
+    int connfd = (int)(long)vargp;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, connfd);
+    while (bench_request(connfd, &rio))
+	;
+    close(connfd);
+    return NULL;
+}
+
+/*
+ * bench_request - serve one request on a kept-alive connection
+ *                 return 1 if the connection stays open, 0 to close it
+ */
+int bench_request(int fd, rio_t *rp)
+{
+    struct stat sbuf;
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    benchreq_t rq;
+
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	return 0;
+    rq.http11 = rq.keepalive = 0;
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+	return bench_error(fd, "400", "Bad Request", &rq);
+    rq.http11 = !strcmp(version, "HTTP/1.1");
+    rq.keepalive = rq.http11;
+    if (bench_requesthdrs(rp, &rq) < 0)
+	return 0;
+    if (strcasecmp(method, "GET"))
+	return bench_error(fd, "501", "Not Implemented", &rq);
+    if (!strncmp(uri, "/synth", 6))
+	return bench_synth(fd, uri, &rq);
+
+    if (parse_uri(uri, filename, cgiargs)) {
+	if (stat(filename, &sbuf) < 0)
+	    return bench_error(fd, "404", "Not found", &rq);
+	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+	    return bench_error(fd, "403", "Forbidden", &rq);
+	return bench_static(fd, filename, sbuf.st_size, &rq);
+    }
+    if (stat(filename, &sbuf) < 0)
+	return bench_error(fd, "404", "Not found", &rq);
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
+	return bench_error(fd, "403", "Forbidden", &rq);
+    return bench_dynamic(fd, filename, cgiargs);
+}
+
+/*
+ * bench_requesthdrs - read the request headers, noting Connection
+ *                     and If-None-Match; return -1 if the client left
+ */
+int bench_requesthdrs(rio_t *rp, benchreq_t *rq)
+{
+    char buf[MAXLINE], *value;
+
+    rq->inm[0] = '\0';
+    while (1) {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
+	if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+	    return 0;
+	if ((value = strchr(buf, ':')) == NULL)
+	    continue;
+	*value++ = '\0';
+	value += strspn(value, " \t");
+	value[strcspn(value, "\r\n")] = '\0';
+	if (!strcasecmp(buf, "Connection"))
+	    rq->keepalive = strcasecmp(value, "close") &&
+		(rq->http11 || !strcasecmp(value, "keep-alive"));
+	else if (!strcasecmp(buf, "If-None-Match"))
+	    strcpy(rq->inm, value);
+    }
+}
+
+/*
+ * bench_header - start a response: status line and common headers
+ */
+void bench_header(char *buf, benchreq_t *rq, char *status)
+{
+    sprintf(buf, "%s %s\r\n", rq->http11 ? "HTTP/1.1" : "HTTP/1.0", status);
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    sprintf(buf + strlen(buf), "Connection: %s\r\n",
+	    rq->keepalive ? "keep-alive" : "close");
+}
+
+/*
+ * bench_static - copy a file to the client with sendfile
+ */
+int bench_static(int fd, char *filename, int filesize, benchreq_t *rq)
+{
+    int srcfd, rc = 0;
+    off_t off = 0;
+    ssize_t n;
+    char filetype[FILETYPE_MAX], buf[MAXBUF];
+
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+	return bench_error(fd, "403", "Forbidden", rq);
+    get_filetype(filename, filetype);
+    bench_header(buf, rq, "200 OK");
+    sprintf(buf + strlen(buf), "Content-length: %d\r\n", filesize);
+    sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	rc = -1;
+    while (rc == 0 && off < filesize) {
+	if ((n = sendfile(fd, srcfd, &off, filesize - off)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    rc = -1;
+    }
+    close(srcfd);
+    return rc == 0 && rq->keepalive;
+}
+
+/*
+ * bench_synth - make up a response as the /synth query asks
+ */
+int bench_synth(int fd, char *uri, benchreq_t *rq)
+{
+    char buf[MAXBUF], etag[32], *query, *param, *value, *save;
+    char *fault = "";
+    long size = 1024, delay = 0, maxage = -1;
+    int useetag = 0, chunked = 0, slow = 0;
+    unsigned long hash = 5381;
+    struct linger lg = { 1, 0 };
+
+    for (query = uri; *query; query++)      /* djb2 of the URI */
+	hash = hash * 33 + (unsigned char)*query;
+    sprintf(etag, "\"%lx\"", hash);
+
+    if ((query = strchr(uri, '?')) != NULL) {
+	for (param = strtok_r(query + 1, "&", &save); param;
+	     param = strtok_r(NULL, "&", &save)) {
+	    if ((value = strchr(param, '=')) != NULL)
+		*value++ = '\0';
+	    else
+		value = "1";
+	    if (!strcmp(param, "size"))
+		size = atol(value);
+	    else if (!strcmp(param, "delay"))
+		delay = atol(value);
+	    else if (!strcmp(param, "maxage"))
+		maxage = atol(value);
+	    else if (!strcmp(param, "etag"))
+		useetag = atoi(value);
+	    else if (!strcmp(param, "chunked"))
+		chunked = atoi(value);
+	    else if (!strcmp(param, "fault"))
+		fault = value;
+	}
+    }
+    if (size < 0 || size > BENCH_MAXSIZE)
+	return bench_error(fd, "400", "Bad Request", rq);
+
+    if (!strcmp(fault, "reset")) {
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	return 0;
+    }
+    if (!strcmp(fault, "stall")) {
+	while (read(fd, buf, sizeof(buf)) > 0)
+	    ;
+	return 0;
+    }
+    if (!strcmp(fault, "close"))
+	rq->keepalive = 0;
+    slow = !strcmp(fault, "slow");
+    if (delay > 0)
+	usleep(delay * 1000);
+
+    if (useetag && !strcmp(rq->inm, etag)) {
+	bench_header(buf, rq, "304 Not Modified");
+	sprintf(buf + strlen(buf), "ETag: %s\r\n", etag);
+	if (maxage >= 0)
+	    sprintf(buf + strlen(buf), "Cache-Control: max-age=%ld\r\n", maxage);
+	strcat(buf, "\r\n");
+	return rio_writen(fd, buf, strlen(buf)) >= 0 && rq->keepalive;
+    }
+
+    if (chunked && !rq->http11)
+	rq->keepalive = 0;                  /* the close ends the body */
+    bench_header(buf, rq, "200 OK");
+    sprintf(buf + strlen(buf), "Content-type: text/plain\r\n");
+    if (maxage >= 0)
+	sprintf(buf + strlen(buf), "Cache-Control: max-age=%ld\r\n", maxage);
+    if (useetag)
+	sprintf(buf + strlen(buf), "ETag: %s\r\n", etag);
+    if (chunked && rq->http11)
+	sprintf(buf + strlen(buf), "Transfer-Encoding: chunked\r\n\r\n");
+    else if (chunked)
+	sprintf(buf + strlen(buf), "\r\n");
+    else
+	sprintf(buf + strlen(buf), "Content-length: %ld\r\n\r\n", size);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return 0;
+    if (!strcmp(fault, "close"))
+	size /= 2;
+    if (bench_body(fd, size, chunked && rq->http11, slow) < 0)
+	return 0;
+    return rq->keepalive;
+}
+
+/*
+ * bench_body - write len bytes of synthetic body, chunked or not
+ */
+int bench_body(int fd, long len, int chunked, int slow)
+{
+    char buf[BENCH_CHUNK + 32];
+    long n, hdr;
+
+    while (len > 0) {
+	n = slow ? BENCH_SLOW_BYTES : BENCH_CHUNK;
+	if (n > len)
+	    n = len;
+	if (chunked) {
+	    hdr = sprintf(buf, "%lx\r\n", n);
+	    memcpy(buf + hdr, bench_fill, n);
+	    memcpy(buf + hdr + n, "\r\n", 2);
+	    if (rio_writen(fd, buf, hdr + n + 2) < 0)
+		return -1;
+	}
+	else if (rio_writen(fd, bench_fill, n) < 0)
+	    return -1;
+	len -= n;
+	if (slow && len > 0)
+	    usleep(BENCH_SLOW_US);
+    }
+    if (chunked && rio_writen(fd, "0\r\n\r\n", 5) < 0)
+	return -1;
+    return 0;
+}
+
+/*
+ * bench_dynamic - run a CGI program; its output runs to the close
+ */
+int bench_dynamic(int fd, char *filename, char *cgiargs)
+{
+    char buf[MAXLINE], env[MAXLINE + 16];
+    char *argv[] = { filename, NULL }, *envp[] = { env, NULL };
+    pid_t pid;
+
+    sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return 0;
+    snprintf(env, sizeof(env), "QUERY_STRING=%s", cgiargs);
+    if ((pid = fork()) == 0) {         /* no setenv: other threads may hold malloc's lock */
+	dup2(fd, STDOUT_FILENO);
+	execve(filename, argv, envp);
+	_exit(1);
+    }
+    if (pid > 0)
+	waitpid(pid, NULL, 0);
+    return 0;
+}
+
+/*
+ * bench_error - answer with an error status and a one-line body
+ */
+int bench_error(int fd, char *errnum, char *shortmsg, benchreq_t *rq)
+{
+    char buf[MAXLINE], status[64];
+
+    sprintf(status, "%s %s", errnum, shortmsg);
+    bench_header(buf, rq, status);
+    sprintf(buf + strlen(buf), "Content-type: text/plain\r\n");
+    sprintf(buf + strlen(buf), "Content-length: %d\r\n\r\n%s\n",
+	    (int)strlen(status) + 1, status);
+    return rio_writen(fd, buf, strlen(buf)) >= 0 && rq->keepalive;
+}
+/* $end bench */
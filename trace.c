@@ -0,0 +1,197 @@
+/**
+ * @file trace.c
+ * @brief Per-request stage timestamps, for the access log and for sampled
+ *        trace spans in Chrome's trace event format
+ *
+ * Times are microseconds on the monotonic clock. A sampled request is
+ * written to the trace file as one span for the whole request and one per
+ * stage, all on the thread that handled it, so chrome://tracing or
+ * Perfetto shows where its time went. The file is a JSON array left open
+ * at the end, which both accept; every process appends whole requests to
+ * it with one write().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+/* Longest trace record for one request */
+#define TRACE_RECORD_MAX 4096
+
+/* Spans between consecutive stage boundaries: the time up to stage i is
+ * named span_names[i] */
+static const char *span_names[TRACE_STAGES] = {
+    NULL, "parse", "cache lookup", "dns", "connect", "send", "origin wait", "respond",
+};
+/* The same, short, for the access log */
+static const char *log_names[TRACE_STAGES] = {
+    NULL, "parse", "lookup", "dns", "connect", "send", "ttfb", "write",
+};
+
+/* The trace file, -1 for none */
+static int trace_fd = -1;
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_start(Trace *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->at[TRACE_ACCEPT] = trace_now();
+}
+
+/**
+ * @brief Record reaching stage, unless it was reached before (a chunk
+ *        fetch connects to the origin again, for instance)
+ */
+void trace_mark(Trace *trace, int stage)
+{
+    if (trace->at[stage] == 0)
+        trace->at[stage] = trace_now();
+}
+
+/**
+ * @brief Write the time spent in each stage that was reached, and the
+ *        total, as "parse=12us lookup=3us ... total=40us"
+ *
+ * @return The length written
+ */
+size_t trace_format(const Trace *trace, char *buf, size_t size)
+{
+    uint64_t prev = trace->at[TRACE_ACCEPT];
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 1; i < TRACE_STAGES && len < size; i++)
+    {
+        if (trace->at[i] == 0)
+            continue;
+        len += snprintf(buf + len, size - len, "%s=%lluus ", log_names[i],
+                        (unsigned long long)(trace->at[i] - prev));
+        prev = trace->at[i];
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len, "total=%lluus",
+                        (unsigned long long)(prev - trace->at[TRACE_ACCEPT]));
+    return len < size ? len : size - 1;
+}
+
+/**
+ * @brief Send sampled requests to the file at path (appended to), or to
+ *        none if path is ""
+ *
+ * May be called again, on a reload: requests being written go to one file
+ * or the other, never to a closed descriptor.
+ *
+ * @return 0 on success, -1 if the file can't be opened (tracing is left as it was)
+ */
+int trace_open(const char *path)
+{
+    int fd;
+
+    if (path[0] == '\0')
+    {
+        if (trace_fd >= 0)
+        {
+            /** keep the descriptor number valid for writers still holding it */
+            if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+            {
+                dup2(fd, trace_fd);
+                close(fd);
+            }
+        }
+        return 0;
+    }
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        return -1;
+    if (lseek(fd, 0, SEEK_END) == 0 && write(fd, "[\n", 2) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (trace_fd < 0)
+        trace_fd = fd;
+    else
+    {
+        dup2(fd, trace_fd);
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether to write out this request: about one in rate, 0 for none
+ */
+int trace_sampled(const Trace *trace, int rate)
+{
+    /** the start time, mixed, is random enough and costs nothing */
+    uint64_t mixed = trace->at[TRACE_ACCEPT] * 0x9E3779B97F4A7C15ULL;
+
+    return trace_fd >= 0 && rate > 0 && (mixed >> 32) % rate == 0;
+}
+
+/** @brief Copy s into a JSON string body, escaped, cut to fit size */
+static void json_escape(const char *s, char *out, size_t size)
+{
+    size_t len = 0;
+
+    for (; *s != '\0' && len + 7 < size; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            out[len++] = '\\';
+            out[len++] = c;
+        }
+        else if (c < 0x20)
+            len += snprintf(out + len, size - len, "\\u%04x", c);
+        else
+            out[len++] = c;
+    }
+    out[len] = '\0';
+}
+
+/**
+ * @brief Append the request's spans to the trace file
+ *
+ * @param url The request's URL, shown as the name of the whole-request span
+ */
+void trace_write(const Trace *trace, const char *url)
+{
+    char record[TRACE_RECORD_MAX], name[1024];
+    uint64_t prev = trace->at[TRACE_ACCEPT];
+    int pid = getpid(), tid = (int)syscall(SYS_gettid);
+    size_t len;
+
+    json_escape(url, name, sizeof(name));
+    len = snprintf(record, sizeof(record),
+                   "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                   "\"pid\":%d,\"tid\":%d},\n",
+                   name, (unsigned long long)trace->at[TRACE_ACCEPT],
+                   (unsigned long long)(trace->at[TRACE_DONE] - trace->at[TRACE_ACCEPT]), pid, tid);
+    for (int i = 1; i < TRACE_STAGES && len < sizeof(record); i++)
+    {
+        if (trace->at[i] == 0)
+            continue;
+        len += snprintf(record + len, sizeof(record) - len,
+                        "{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                        "\"pid\":%d,\"tid\":%d},\n",
+                        span_names[i], (unsigned long long)prev,
+                        (unsigned long long)(trace->at[i] - prev), pid, tid);
+        prev = trace->at[i];
+    }
+    /** a cut-short record would break the file: drop it instead */
+    if (len >= sizeof(record))
+        return;
+    if (write(trace_fd, record, len) < 0)
+        return; /* tracing is best effort */
+}
@@ -0,0 +1,37 @@
+/**
+ * @file trace.h
+ * @brief Per-request stage timestamps, for the access log and for sampled
+ *        trace spans in Chrome's trace event format
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stage boundaries, in the order a request reaches them; a request that
+ * is answered from the cache skips the origin ones */
+#define TRACE_ACCEPT 0     /* the connection's thread starts */
+#define TRACE_PARSED 1     /* request line and headers read */
+#define TRACE_LOOKUP 2     /* cache lookup done */
+#define TRACE_RESOLVED 3   /* origin's address looked up */
+#define TRACE_CONNECTED 4  /* connected to the origin */
+#define TRACE_SENT 5       /* request sent to the origin */
+#define TRACE_FIRST_BYTE 6 /* origin's status line received */
+#define TRACE_DONE 7       /* response sent to the client */
+#define TRACE_STAGES 8
+
+typedef struct
+{
+    uint64_t at[TRACE_STAGES]; /* trace_now() at each boundary, 0 if not reached */
+} Trace;
+
+uint64_t trace_now(void);
+void trace_start(Trace *trace);
+void trace_mark(Trace *trace, int stage);
+size_t trace_format(const Trace *trace, char *buf, size_t size);
+int trace_open(const char *path);
+int trace_sampled(const Trace *trace, int rate);
+void trace_write(const Trace *trace, const char *url);
+
+#endif /* __TRACE_H__ */